@@ -0,0 +1,134 @@
+/*
+ * Lookup latency of a frozen index against the pointer-based tree it
+ * came from: btree::find against static_btree::find on the same keys,
+ * and for uint64_t keys also against a learned static_btree (freeze
+ * with a maxError), over key sets of different smoothness.
+ *
+ * Header-only like the rest of the library; build and run by hand:
+ *
+ *    g++ -std=c++17 -O2 -DNDEBUG -I.. freeze_bench.cpp -o freeze_bench
+ *    ./freeze_bench [elements] [lookups] [maxError]
+ *
+ * Lookups are keys drawn from the set in random order, so every one is
+ * a hit.  Each time is the best of a few runs.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "btree.h"
+#include "static_btree.h"
+
+namespace {
+
+//Best wall time of a few runs of fn, in seconds
+template <typename Function>
+double best_of(Function fn) {
+   double best = 1e30;
+   for (int run = 0; run < 3; ++run) {
+      auto start = std::chrono::steady_clock::now();
+      fn();
+      std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+      best = std::min(best, took.count());
+   }
+   return best;
+}
+
+//Times find on every probe, returning the seconds taken; found counts
+//the hits, so the lookups cannot be optimised away
+template <typename Index, typename Key>
+double time_finds(const Index& index, const std::vector<Key>& probes, size_t& found) {
+   return best_of([&] {
+      found = 0;
+      for (const Key& key : probes) {
+         found += index.find(key) != index.end();
+      }
+   });
+}
+
+void report(const char* what, double seconds, size_t lookups, size_t found) {
+   std::printf("  %-20s %8.3f s  %6.1f ns/lookup  (%zu found)\n", what, seconds, seconds * 1e9 / lookups, found);
+}
+
+//Times the three lookup paths over one uint64_t key set. Returns whether
+//every lookup was a hit in all of them
+template <typename Generate>
+bool run_learned(const char* name, size_t elements, size_t lookups, size_t maxError, Generate generate) {
+   std::mt19937_64 rng(2);
+   std::vector<uint64_t> keys(elements);
+   for (size_t i = 0; i < elements; ++i) {
+      keys[i] = generate(i, rng);
+   }
+   std::sort(keys.begin(), keys.end());
+   keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+   //inserted in random order: this btree grows a chain from sorted input
+   std::shuffle(keys.begin(), keys.end(), rng);
+   btree<uint64_t> tree(40);
+   for (uint64_t key : keys) {
+      tree.insert(key);
+   }
+   std::vector<uint64_t> probes(lookups);
+   for (uint64_t& key : probes) {
+      key = keys[rng() % keys.size()];
+   }
+   static_btree<uint64_t> frozen = tree.freeze();
+   static_btree<uint64_t> learned = tree.freeze(maxError);
+
+   size_t treeFound, frozenFound, learnedFound;
+   double treeTime = time_finds(tree, probes, treeFound);
+   double frozenTime = time_finds(frozen, probes, frozenFound);
+   double learnedTime = time_finds(learned, probes, learnedFound);
+   std::printf("%s uint64_t keys, %zu elements, %zu lookups, maxError %zu (%zu segments, %zu levels)\n", name,
+               elements, lookups, maxError, learned.learned()->segment_count(), learned.learned()->level_count());
+   report("btree::find", treeTime, lookups, treeFound);
+   report("static_btree::find", frozenTime, lookups, frozenFound);
+   report("learned find", learnedTime, lookups, learnedFound);
+   return treeFound == lookups && frozenFound == lookups && learnedFound == lookups;
+}
+
+}
+
+int main(int argc, char** argv) {
+   size_t elements = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4000000;
+   size_t lookups = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4000000;
+   size_t maxError = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64;
+
+   std::mt19937_64 rng(1);
+   btree<int> tree(40);
+   std::vector<int> keys;
+   keys.reserve(elements);
+   while (keys.size() < elements) {
+      int key = static_cast<int>(rng());
+      if (tree.insert(key).second) {
+         keys.push_back(key);
+      }
+   }
+   std::vector<int> probes(lookups);
+   for (int& key : probes) {
+      key = keys[rng() % keys.size()];
+   }
+   static_btree<int> frozen = tree.freeze();
+
+   size_t treeFound, frozenFound;
+   double treeTime = time_finds(tree, probes, treeFound);
+   double frozenTime = time_finds(frozen, probes, frozenFound);
+   std::printf("%zu random ints, %zu lookups\n", elements, lookups);
+   report("btree::find", treeTime, lookups, treeFound);
+   report("static_btree::find", frozenTime, lookups, frozenFound);
+   bool ok = treeFound == lookups && frozenFound == lookups;
+
+   //evenly spaced with a little jitter: a few segments fit it
+   ok &= run_learned("near-linear", elements, lookups, maxError,
+                     [](size_t i, std::mt19937_64& r) { return i * 1000 + r() % 100; });
+   ok &= run_learned("uniform random", elements, lookups, maxError,
+                     [](size_t, std::mt19937_64& r) { return static_cast<uint64_t>(r()); });
+   ok &= run_learned("exponential", elements, lookups, maxError, [](size_t, std::mt19937_64& r) {
+      return static_cast<uint64_t>(std::exponential_distribution<double>(1.0)(r) * 1e15);
+   });
+   return ok ? 0 : 1;
+}
@@ -19,28 +19,193 @@
 #include <algorithm>
 #include <stdexcept>
 #include <map>
+#include <thread>
+#include <atomic>
+#include <optional>
+#include <tuple>
+#include <limits>
+#include <type_traits>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <unordered_map>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <fstream>
 
 
 // we better include the iterator
 #include "btree_iterator.h"
+#include "btree_codec.h"
+#include "btree_filter.h"
+#include "btree_key.h"
+#include "btree_block.h"
+#include "static_btree.h"
 
 // we do this to avoid compiler errors about non-template friends
 // what do we do, remember? :)
 
-template <typename T> class btree;
+template <typename T, typename Augment> class btree;
+template <typename T, typename Augment>
+std::ostream &operator<<(std::ostream &os, const btree<T, Augment> &tree);
+template <typename T, typename Augment> class btree_checkpoint;
+
+// Every open checkpoint file (see btree_checkpoint.h) holds a token.
+// Nodes remember the token of the file they were last written to, and
+// report their id here when destroyed so the file can drop their records.
+class btree_retired_nodes {
+ public:
+   static uint64_t open() {
+      std::lock_guard<std::mutex> lock{state().mutex};
+      uint64_t token = ++state().lastToken;
+      state().retired[token];
+      return token;
+   }
+
+   static void close(uint64_t token) {
+      std::lock_guard<std::mutex> lock{state().mutex};
+      state().retired.erase(token);
+   }
+
+   static void retire(uint64_t token, uint64_t id) {
+      std::lock_guard<std::mutex> lock{state().mutex};
+      auto found = state().retired.find(token);
+      if (found != state().retired.end()) {
+         found->second.push_back(id);
+      }
+   }
+
+   //Takes the ids retired under token since the last call
+   static std::vector<uint64_t> drain(uint64_t token) {
+      std::lock_guard<std::mutex> lock{state().mutex};
+      std::vector<uint64_t> ids;
+      ids.swap(state().retired[token]);
+      return ids;
+   }
+
+ private:
+   struct State {
+      std::mutex mutex;
+      uint64_t lastToken = 0;
+      std::unordered_map<uint64_t, std::vector<uint64_t>> retired;
+   };
+
+   static State& state() {
+      static State s;
+      return s;
+   }
+};
+
+// Execution policies for the whole-tree algorithms (for_each and
+// transform_reduce).  These are our own tags rather than std::execution,
+// whose libstdc++ implementation drags in a TBB link dependency.
+namespace btree_execution {
+   struct sequenced_policy {
+      size_t concurrency() const {
+         return 1;
+      }
+   };
+   struct parallel_policy {
+      // 0 picks std::thread::hardware_concurrency()
+      size_t threads = 0;
+
+      size_t concurrency() const {
+         return threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+      }
+   };
+   inline constexpr sequenced_policy seq{};
+   inline constexpr parallel_policy par{};
+}
+
+// Augmentations.  A btree<T, Augment> caches in every node a summary of
+// the subtree below it, so that aggregates over a range of elements can
+// be assembled from whole subtrees instead of visiting each element.
+// Augment describes a monoid over T:
+//
+//   struct Augment {
+//      typedef ... value_type;
+//      static value_type identity();
+//      static value_type lift(const T& elem);
+//      static value_type combine(const value_type& lhs, const value_type& rhs);
+//   };
+//
+// combine must be associative with identity() as its neutral element.  It
+// need not be commutative; summaries are always combined in element order.
+// The default Augment, void, keeps no summaries.
+template <typename Augment>
+struct btree_summary {
+   typedef typename Augment::value_type type;
+};
+
+template <>
+struct btree_summary<void> {
+   struct type {};
+};
+
+// Whether std::hash knows T, which a btree needs before it can keep a
+// filter of its elements.  std::hash of an unsupported type is a
+// "disabled" specialisation that cannot be constructed.
+template <typename T>
+struct btree_hashable : std::is_default_constructible<std::hash<T>> {};
+
+// Whether nodes keep the key prefixes of their elements to search by.
+// That pays off for strings, whose comparison chases a pointer and
+// loops over bytes, and for pairs and tuples that lead with one; when
+// the leading member is a number, comparing it is as cheap as comparing
+// a prefix.  Specialise to opt another encodable type in.
+template <typename T>
+struct btree_prefixed : std::false_type {};
+
+template <>
+struct btree_prefixed<std::string> : std::true_type {};
+
+template <typename A, typename B>
+struct btree_prefixed<std::pair<A, B>>
+      : std::integral_constant<bool, btree_prefixed<A>::value && btree_key_encoder<std::pair<A, B>>::enabled> {};
+
+template <typename A, typename... Rest>
+struct btree_prefixed<std::tuple<A, Rest...>>
+      : std::integral_constant<bool, btree_prefixed<A>::value && btree_key_encoder<std::tuple<A, Rest...>>::enabled> {};
+
+template <typename T>
+struct btree_sum {
+   typedef T value_type;
+   static T identity() { return T(); }
+   static T lift(const T& elem) { return elem; }
+   static T combine(const T& lhs, const T& rhs) { return lhs + rhs; }
+};
+
 template <typename T>
-std::ostream &operator<<(std::ostream &os, const btree<T> &tree);
+struct btree_min {
+   typedef T value_type;
+   static T identity() { return std::numeric_limits<T>::max(); }
+   static T lift(const T& elem) { return elem; }
+   static T combine(const T& lhs, const T& rhs) { return std::min(lhs, rhs); }
+};
 
-template <typename T> 
+template <typename T>
+struct btree_max {
+   typedef T value_type;
+   static T identity() { return std::numeric_limits<T>::lowest(); }
+   static T lift(const T& elem) { return elem; }
+   static T combine(const T& lhs, const T& rhs) { return std::max(lhs, rhs); }
+};
+
+template <typename T, typename Augment> 
 class btree {
  public:
   /** Hmm, need some iterator typedefs here... friends? **/
-    typedef btree_iterator<T>                                 iterator;
-    typedef const_btree_iterator<T>                           const_iterator;
+    typedef btree_iterator<T, Augment>                                 iterator;
+    typedef const_btree_iterator<T, Augment>                           const_iterator;
     typedef std::reverse_iterator<const_iterator>             const_reverse_iterator;
     typedef std::reverse_iterator<iterator>                   reverse_iterator;
-    friend class btree_iterator<T>;
-    friend class const_btree_iterator<T>;
+    friend class btree_iterator<T, Augment>;
+    friend class const_btree_iterator<T, Augment>;
+    friend class btree_checkpoint<T, Augment>;
+    typedef typename btree_summary<Augment>::type             summary_type;
 
   /**
    * Constructs an empty btree.  Note that
@@ -55,7 +220,7 @@ class btree {
    *        that can be stored in each B-Tree node
    */
    btree(size_t maxNodeElems = 40) {
-      rootNode = std::make_shared<Node>(this, nullptr, maxNodeElems);
+      rootNode = Node::create(nullptr, maxNodeElems);
    };
 
   /**
@@ -73,14 +238,16 @@ class btree {
    *
    * @param original a const lvalue reference to a B-Tree object
    */
-  btree(const btree<T>& original) {
+  btree(const btree<T, Augment>& original) {
     if (original.rootNode == nullptr) {
       rootNode = nullptr;
     } else {
-      rootNode = std::make_shared<Node>(*original.rootNode);
-      rootNode->changeRoot(this);
+      rootNode = Node::create(*original.rootNode);
       rootNode->changeParent(nullptr);
     }
+    if (original.filter != nullptr) {
+      filter = std::make_unique<Filter>(*original.filter);
+    }
   }
 
   /** 
@@ -89,9 +256,10 @@ class btree {
    *
    * @param original an rvalue reference to a B-Tree object
    */
-  btree(btree<T>&& original): rootNode{std::move(original.rootNode)} {
-    rootNode->changeRoot(this);
-    rootNode->changeParent(nullptr);
+  btree(btree<T, Augment>&& original) {
+    original.settleCheckpoint();
+    rootNode = std::move(original.rootNode);
+    filter = std::move(original.filter);
   }
   
   
@@ -101,13 +269,12 @@ class btree {
    *
    * @param rhs a const lvalue reference to a B-Tree object
    */
-  btree<T>& operator=(const btree<T>& rhs) {
+  btree<T, Augment>& operator=(const btree<T, Augment>& rhs) {
     if (this != &rhs) {
+      settleCheckpoint();
       rootNode.reset();
-      btree<T> tmp{rhs};
+      btree<T, Augment> tmp{rhs};
       *this = std::move(tmp);
-      rootNode->changeRoot(this);
-      rootNode->changeParent(nullptr);
     }
     return *this;
   }
@@ -119,12 +286,14 @@ class btree {
    *
    * @param rhs a const reference to a B-Tree object
    */
-  btree<T>& operator=(btree<T>&& rhs) {
+  btree<T, Augment>& operator=(btree<T, Augment>&& rhs) {
     if (this != &rhs) {
+      settleCheckpoint();
+      rhs.settleCheckpoint();
       rootNode.reset();
       rootNode = std::move(rhs.rootNode);
-      rootNode->changeRoot(this);
       rhs.rootNode = nullptr;
+      filter = std::move(rhs.filter);
     }
     return *this;
   }
@@ -138,7 +307,7 @@ class btree {
    * @param tree a const reference to a B-Tree object
    * @return a reference to os
 */
-   friend std::ostream& operator<<(std::ostream& os, const btree<T>& tree) {
+   friend std::ostream& operator<<(std::ostream& os, const btree<T, Augment>& tree) {
       auto it = tree.cbegin();
       if (it != tree.cend()) {
         os << (*it);
@@ -206,7 +375,16 @@ class btree {
     *         non-const end() returns if no such match was ever found.
     */
    iterator find(const T& elem) {
-      return rootNode->nodeFind(elem);
+      if (filterRejects(elem)) {
+         return end();
+      }
+      size_t pos;
+      Node* node = rootNode->nodeFind(elem, pos);
+      if (node == nullptr) {
+         filterMissed();
+         return end();
+      }
+      return iterator(node, node->val.begin() + pos);
    }
 
   /**
@@ -219,8 +397,103 @@ class btree {
     *         const end() returns if no such match was ever found.
     */
     const_iterator find(const T& elem) const {
-      return rootNode->cNodeFind(elem);
+      if (filterRejects(elem)) {
+         return cend();
+      }
+      size_t pos;
+      const Node* node = rootNode->nodeFind(elem, pos);
+      if (node == nullptr) {
+         filterMissed();
+         return cend();
+      }
+      return const_iterator(node, node->val.cbegin() + pos);
     }
+
+  /**
+    * Returns an iterator to the first element not less than elem, or
+    * end() if every element is less than elem.
+    *
+    * @param elem the element to search for.
+    * @return an iterator to the first element not less than elem.
+    */
+   iterator lower_bound(const T& elem) {
+      size_t pos;
+      Node* node = rootNode->nodeLowerBound(elem, pos);
+      return node != nullptr ? iterator(node, node->val.begin() + pos) : end();
+   }
+
+   const_iterator lower_bound(const T& elem) const {
+      size_t pos;
+      const Node* node = rootNode->nodeLowerBound(elem, pos);
+      return node != nullptr ? const_iterator(node, node->val.cbegin() + pos) : cend();
+   }
+
+  /**
+    * Finger search: looks elem up starting from hint rather than from
+    * the root.  The search climbs from hint's node only until it reaches
+    * a subtree whose bounds enclose elem, then descends from there, so
+    * looking up an element d positions away from the last one costs
+    * O(log d) rather than O(log n).
+    *
+    * @param hint any valid iterator into this btree, end() included;
+    *        typically the result of the previous lookup.
+    * @param elem the element to search for.
+    * @return an iterator to the matching element, or end().
+    */
+   iterator find(const_iterator hint, const T& elem) {
+      size_t pos;
+      Node* node = fingerFind(hint.ptr, elem, pos);
+      return node != nullptr ? iterator(node, node->val.begin() + pos) : end();
+   }
+
+   const_iterator find(const_iterator hint, const T& elem) const {
+      size_t pos;
+      const Node* node = fingerFind(hint.ptr, elem, pos);
+      return node != nullptr ? const_iterator(node, node->val.cbegin() + pos) : cend();
+   }
+
+  /**
+    * Finger search for the first element not less than elem, starting
+    * from hint as find(hint, elem) does.
+    *
+    * @param hint any valid iterator into this btree, end() included.
+    * @param elem the element to search for.
+    * @return an iterator to the first element not less than elem.
+    */
+   iterator lower_bound(const_iterator hint, const T& elem) {
+      size_t pos;
+      Node* node = fingerLowerBound(hint.ptr, elem, pos);
+      return node != nullptr ? iterator(node, node->val.begin() + pos) : end();
+   }
+
+   const_iterator lower_bound(const_iterator hint, const T& elem) const {
+      size_t pos;
+      const Node* node = fingerLowerBound(hint.ptr, elem, pos);
+      return node != nullptr ? const_iterator(node, node->val.cbegin() + pos) : cend();
+   }
+
+  /**
+    * Copies the elements into an immutable static_btree laid out in one
+    * contiguous array, for an index that has stopped changing. The
+    * augmentation is not carried over.
+    *
+    * @return a static_btree with the same elements and read API.
+    */
+   static_btree<T> freeze() const {
+      return static_btree<T>(begin(), end());
+   }
+
+  /**
+    * As freeze(), also building a learned index over the elements, which
+    * must be integers.
+    *
+    * @param maxError how many ranks the learned index may be off by.
+    */
+   static_btree<T> freeze(size_t maxError) const {
+      static_btree<T> frozen(begin(), end());
+      frozen.learn(maxError);
+      return frozen;
+   }
       
   /**
     * Operation which inserts the specified element
@@ -250,7 +523,575 @@ class btree {
     *         because no matching element was there prior to the insert call.
     */
    std::pair<iterator, bool> insert(const T& elem) {
-      return rootNode->nodeInsert(elem);
+      auto guard = preserveFor(elem, false);
+      return filterAdded(rootNode->nodeInsert(elem));
+   }
+
+   std::pair<iterator, bool> insert(T&& elem) {
+      auto guard = preserveFor(elem, false);
+      return filterAdded(rootNode->nodeInsert(std::move(elem)));
+   }
+
+  /**
+    * A node handle owns an element that has been extracted from a
+    * btree, so it can be inserted into another btree (or back into the
+    * same one) by moving rather than copying it.
+    */
+   class node_type {
+    public:
+      node_type() = default;
+
+      bool empty() const {
+         return !elem.has_value();
+      }
+      explicit operator bool() const {
+         return !empty();
+      }
+      T& value() {
+         return *elem;
+      }
+      const T& value() const {
+         return *elem;
+      }
+
+    private:
+      friend class btree<T, Augment>;
+      explicit node_type(T&& e): elem{std::move(e)} {}
+
+      std::optional<T> elem;
+   };
+
+   struct insert_return_type {
+      iterator position;
+      bool inserted;
+      node_type node;
+   };
+
+  /**
+    * Removes the element matching elem, if there is one.  Elements
+    * stored below it are pulled up to fill the gap it leaves.
+    *
+    * @param elem the element to remove.
+    * @return the number of elements removed (0 or 1).
+    */
+   size_t erase(const T& elem) {
+      return extract(elem).empty() ? 0 : 1;
+   }
+
+  /**
+    * Unlinks the element matching elem from the btree and hands it back
+    * in a node handle, moving rather than copying it.
+    *
+    * @param elem the element to extract.
+    * @return a node handle owning the element, or an empty handle if no
+    *         such element was found.
+    */
+   node_type extract(const T& elem) {
+      if (filterRejects(elem)) {
+         return node_type();
+      }
+      auto guard = preserveFor(elem, true);
+      size_t pos;
+      Node* node = rootNode->nodeFind(elem, pos);
+      if (node == nullptr) {
+         filterMissed();
+         return node_type();
+      }
+      node_type nh(eraseAt(node, pos));
+      filterErased();
+      return nh;
+   }
+
+  /**
+    * Inserts the element owned by a node handle.  If a matching element
+    * is already present the handle is returned untouched in the node
+    * field of the result, mirroring std::set::insert.
+    *
+    * @param nh the node handle to insert from; may be empty.
+    * @return the position of the matching element, whether it was
+    *         inserted, and the handle if it was not.
+    */
+   insert_return_type insert(node_type&& nh) {
+      if (nh.empty()) {
+         return {end(), false, node_type()};
+      }
+      auto found = find(nh.value());
+      if (found != end()) {
+         return {found, false, std::move(nh)};
+      }
+      auto guard = preserveFor(nh.value(), false);
+      auto result = filterAdded(rootNode->nodeInsert(std::move(*nh.elem)));
+      nh.elem.reset();
+      return {result.first, true, node_type()};
+   }
+
+  /**
+    * Moves every element of source that is not already present into
+    * this btree, with the semantics of std::set::merge: elements that
+    * clash stay behind in source.  Runs of source elements that fall
+    * into an empty gap of this btree are relinked there as whole
+    * subtrees, so no element is copied and no node is reallocated for
+    * them.
+    *
+    * @param source the btree to drain.
+    */
+   void merge(btree<T, Augment>& source) {
+      if (&source == this) {
+         return;
+      }
+      settleCheckpoint();
+      source.settleCheckpoint();
+      size_t sourceMaxSize = source.rootNode->maxSize;
+      NodePtr src = source.takeRoot();
+      NodePtr clashes;
+      if (rootNode->val.empty()) {
+         if (src != nullptr) {
+            rootNode = std::move(src);
+            rootNode->parent = nullptr;
+         }
+      } else {
+         mergeInto(rootNode.get(), std::move(src), clashes);
+      }
+      source.rootNode = std::move(clashes);
+      source.restoreRoot(sourceMaxSize);
+      refilter();
+   }
+
+   void merge(btree<T, Augment>&& source) {
+      merge(source);
+   }
+
+  /**
+    * Builds a btree in one pass from an arbitrary range of elements,
+    * which need not be sorted and may contain duplicates.  This is
+    * much cheaper than calling insert once per element: the input is
+    * sorted and deduplicated in parallel, and the tree is then laid out
+    * bottom-up with every internal node full, the subtrees hanging off
+    * the top of the tree being built concurrently.
+    *
+    * @param first, last the range of elements to load.
+    * @param threads the number of worker threads to use; 0 or 1 builds
+    *        on the calling thread only.
+    * @param maxNodeElems the maximum number of elements per node.
+    * @return a btree holding every distinct element of [first, last).
+    */
+   template <typename InputIt>
+   static btree<T, Augment> build(InputIt first, InputIt last,
+                         size_t threads = std::thread::hardware_concurrency(),
+                         size_t maxNodeElems = 40) {
+      std::vector<T> elems(first, last);
+      parallelSort(elems, threads);
+      elems.erase(std::unique(elems.begin(), elems.end()), elems.end());
+
+      btree<T, Augment> tree(maxNodeElems);
+      if (!elems.empty()) {
+         tree.rootNode = buildNode(elems.data(), elems.size(), nullptr,
+                                   maxNodeElems, threads);
+      }
+      return tree;
+   }
+
+  /**
+    * Returns the Augment summary of every element in the btree, which
+    * is cached at the root.
+    */
+   summary_type aggregate() const {
+      static_assert(!std::is_void<Augment>::value, "aggregate needs a btree with an Augment");
+      return rootNode->summary;
+   }
+
+  /**
+    * Returns the Augment summary of the elements in [lo, hi).  Subtrees
+    * that lie wholly inside the range contribute their cached summary,
+    * so only the two paths down to lo and hi are walked, giving
+    * O(log n) work rather than a scan of the range.
+    *
+    * @param lo the smallest element to include.
+    * @param hi the first element past the range.
+    * @return the combined summary, or Augment::identity() if the range
+    *         is empty.
+    */
+   summary_type aggregate(const T& lo, const T& hi) const {
+      static_assert(!std::is_void<Augment>::value, "aggregate needs a btree with an Augment");
+      if (!(lo < hi)) {
+         return Augment::identity();
+      }
+      return rootNode->aggregate(&lo, &hi);
+   }
+
+  /**
+    * Moves every element not less than key out of this btree and
+    * returns them as a btree of their own, leaving the smaller elements
+    * behind.  Only the nodes on the path to key are reshaped; every
+    * subtree hanging off that path moves across untouched.
+    *
+    * @param key the smallest element that goes to the returned tree.
+    * @return a btree holding the elements of this one not less than key.
+    */
+   btree<T, Augment> split(const T& key) {
+      settleCheckpoint();
+      size_t maxSize = rootNode->maxSize;
+      std::optional<T> match;
+      auto halves = splitNode(takeRoot(), key, match);
+      rootNode = halves.first;
+      if (match) {
+         halves.second = joinNodes(nullptr, std::move(*match), std::move(halves.second), maxSize);
+      }
+      restoreRoot(maxSize);
+      return fromRoot(std::move(halves.second), maxSize);
+   }
+
+  /**
+    * Concatenates two btrees, every element of left being less than
+    * every element of right.  The nodes of both trees are reused, so this
+    * costs a walk down the right edge of left rather than a copy.
+    *
+    * @param left, right the btrees to concatenate.
+    * @return a btree holding the elements of both.
+    * @throws std::invalid_argument if the trees overlap.
+    */
+   static btree<T, Augment> join(btree<T, Augment> left, btree<T, Augment> right) {
+      size_t maxSize = left.rootNode->maxSize;
+      if (left.begin() != left.end() && right.begin() != right.end() &&
+          !(*--left.end() < *right.begin())) {
+         throw std::invalid_argument("btree::join: left and right overlap");
+      }
+      return fromRoot(joinNodes(left.takeRoot(), right.takeRoot()), maxSize);
+   }
+
+  /**
+    * Set algebra over two btrees.  The root of a supplies pivots that b
+    * is split around; the pieces are combined recursively with the
+    * matching children of a and joined back together, so subtrees that
+    * one side does not interleave with are reused whole.  This takes
+    * O(m log(n/m + 1)) work for trees of m <= n elements instead of the
+    * O(m log n) of probing one tree with every element of the other.
+    * With a parallel policy the independent subproblems run concurrently.
+    *
+    * Both arguments are consumed, so pass by std::move to avoid copies.
+    * Where both trees hold an element, the copy from a is kept.
+    *
+    * @param policy btree_execution::seq or btree_execution::par.
+    * @param a, b the operands.
+    * @return the union, intersection or difference (a minus b).
+    */
+   static btree<T, Augment> set_union(btree<T, Augment> a, btree<T, Augment> b) {
+      return set_union(btree_execution::seq, std::move(a), std::move(b));
+   }
+
+   template <typename Policy>
+   static btree<T, Augment> set_union(const Policy& policy, btree<T, Augment> a, btree<T, Augment> b) {
+      return setAlgebra(std::move(a), std::move(b), SetOp::unite, policy.concurrency());
+   }
+
+   static btree<T, Augment> set_intersection(btree<T, Augment> a, btree<T, Augment> b) {
+      return set_intersection(btree_execution::seq, std::move(a), std::move(b));
+   }
+
+   template <typename Policy>
+   static btree<T, Augment> set_intersection(const Policy& policy, btree<T, Augment> a, btree<T, Augment> b) {
+      return setAlgebra(std::move(a), std::move(b), SetOp::intersect, policy.concurrency());
+   }
+
+   static btree<T, Augment> set_difference(btree<T, Augment> a, btree<T, Augment> b) {
+      return set_difference(btree_execution::seq, std::move(a), std::move(b));
+   }
+
+   template <typename Policy>
+   static btree<T, Augment> set_difference(const Policy& policy, btree<T, Augment> a, btree<T, Augment> b) {
+      return setAlgebra(std::move(a), std::move(b), SetOp::subtract, policy.concurrency());
+   }
+
+  /**
+    * Applies fn to every element of the btree.  Under the sequenced
+    * policy elements are visited in order on the calling thread.  Under
+    * the parallel policy the tree is cut into independent subtrees that
+    * are visited concurrently, so fn must be safe to call from several
+    * threads at once and no visiting order is guaranteed.
+    *
+    * @param policy btree_execution::seq or btree_execution::par.
+    * @param fn a callable taking a const T&.
+    */
+   template <typename Function>
+   void for_each(btree_execution::sequenced_policy, Function fn) const {
+      rootNode->visit(fn);
+   }
+
+   template <typename Function>
+   void for_each(const btree_execution::parallel_policy& policy, Function fn) const {
+      std::vector<const T*> top;
+      auto subtrees = partition(policy.concurrency(), top);
+      for (auto elem : top) {
+         fn(*elem);
+      }
+      runTasks(policy.concurrency(), subtrees.size(), [&](size_t i) {
+         subtrees[i]->visit(fn);
+      });
+   }
+
+  /**
+    * Reduces transform(elem) over every element of the btree, starting
+    * from init.  As with std::transform_reduce, reduce must be
+    * associative and commutative for the parallel policy to give the
+    * same answer as the sequenced one.
+    *
+    * @param policy btree_execution::seq or btree_execution::par.
+    * @param init the initial value of the reduction.
+    * @param reduce a binary callable combining two partial results.
+    * @param transform a callable mapping a const T& to a partial result.
+    * @return the reduction of init and every transformed element.
+    */
+   template <typename R, typename Reduce, typename Transform>
+   R transform_reduce(btree_execution::sequenced_policy, R init,
+                      Reduce reduce, Transform transform) const {
+      rootNode->visit([&](const T& elem) {
+         init = reduce(std::move(init), transform(elem));
+      });
+      return init;
+   }
+
+   template <typename R, typename Reduce, typename Transform>
+   R transform_reduce(const btree_execution::parallel_policy& policy, R init,
+                      Reduce reduce, Transform transform) const {
+      std::vector<const T*> top;
+      auto subtrees = partition(policy.concurrency(), top);
+      for (auto elem : top) {
+         init = reduce(std::move(init), transform(*elem));
+      }
+
+      std::vector<std::optional<R>> partial(subtrees.size());
+      runTasks(policy.concurrency(), subtrees.size(), [&](size_t i) {
+         auto& acc = partial[i];
+         subtrees[i]->visit([&](const T& elem) {
+            acc = acc ? reduce(std::move(*acc), transform(elem)) : R(transform(elem));
+         });
+      });
+      for (auto& acc : partial) {
+         if (acc) {
+            init = reduce(std::move(init), std::move(*acc));
+         }
+      }
+      return init;
+   }
+
+  /**
+    * Writes the btree to os in a compact, versioned binary format.
+    * Elements go out in order, in blocks of up to 4096, each block
+    * encoded with btree_codec<T> (varint deltas for integral types,
+    * length-prefixed strings) and followed by its CRC-32.
+    *
+    * @param os the stream to write to; should be opened in binary mode.
+    * @throws std::runtime_error if the stream goes bad.
+    */
+   void save(std::ostream& os) const {
+      uint64_t count = 0;
+      rootNode->visit([&count](const T&) { ++count; });
+
+      std::string header(snapshotMagic, 4);
+      btree_bytes::putFixed<uint32_t>(header, snapshotVersion);
+      btree_bytes::putFixed<uint64_t>(header, count);
+      btree_bytes::putFixed<uint32_t>(header, static_cast<uint32_t>(rootNode->maxSize));
+      os.write(header.data(), header.size());
+
+      SnapshotWriter writer{os};
+      rootNode->visit([&writer](const T& elem) { writer.add(elem); });
+      writer.flush();
+      writer.finish();
+      if (!os) {
+         throw std::runtime_error("btree::save: write failed");
+      }
+   }
+
+  /**
+    * Replaces the contents of the btree with a snapshot written by save.
+    * Blocks are checksummed and decoded straight into a sorted array that
+    * feeds the bottom-up builder, so loading costs little more than the
+    * read itself.  The node capacity recorded in the snapshot is used.
+    *
+    * @param is the stream to read from; should be opened in binary mode.
+    * @throws std::runtime_error if the snapshot is truncated, corrupt or
+    *         of an unknown version.  The btree is unchanged in that case.
+    */
+   void load(std::istream& is) {
+      settleCheckpoint();
+      char header[20];
+      if (!is.read(header, sizeof(header)) || std::memcmp(header, snapshotMagic, 4) != 0) {
+         throw std::runtime_error("btree::load: not a btree snapshot");
+      }
+      if (btree_bytes::getFixed<uint32_t>(header + 4) != snapshotVersion) {
+         throw std::runtime_error("btree::load: unsupported snapshot version");
+      }
+      uint64_t count = btree_bytes::getFixed<uint64_t>(header + 8);
+      size_t maxSize = btree_bytes::getFixed<uint32_t>(header + 16);
+      if (maxSize == 0 || maxSize > snapshotMaxNodeElems) {
+         throw std::runtime_error("btree::load: bad node capacity");
+      }
+
+      //nothing is sized from the header: elems grows a verified block at
+      //a time, and a block only as its bytes arrive
+      std::vector<T> elems;
+      std::string block;
+      for (;;) {
+         char frame[8];
+         if (!is.read(frame, sizeof(frame))) {
+            throw std::runtime_error("btree::load: truncated snapshot");
+         }
+         size_t n = btree_bytes::getFixed<uint32_t>(frame);
+         size_t bytes = btree_bytes::getFixed<uint32_t>(frame + 4);
+         if (n == 0) {
+            break;
+         }
+         if (n > snapshotBlockElems || elems.size() + n > count) {
+            throw std::runtime_error("btree::load: bad block");
+         }
+         readSnapshotBlock(is, block, bytes + 4);
+         if (btree_crc32(block.data(), bytes) != btree_bytes::getFixed<uint32_t>(&block[bytes])) {
+            throw std::runtime_error("btree::load: block checksum mismatch");
+         }
+         elems.reserve(elems.size() + n);
+
+         const char* in = block.data();
+         const char* end = in + bytes;
+         for (size_t i = 0; i < n; ++i) {
+            const T* prev = i == 0 ? nullptr : &elems.back();
+            T elem = btree_codec<T>::decode(in, end, prev);
+            if (!elems.empty() && !(elems.back() < elem)) {
+               throw std::runtime_error("btree::load: elements out of order");
+            }
+            elems.push_back(std::move(elem));
+         }
+      }
+      if (elems.size() != count) {
+         throw std::runtime_error("btree::load: element count mismatch");
+      }
+
+      rootNode = elems.empty() ? Node::create(nullptr, maxSize)
+                               : buildNode(elems.data(), elems.size(), nullptr, maxSize,
+                                           std::thread::hardware_concurrency());
+      refilter();
+   }
+
+   struct filter_stats {
+      size_t bits_per_key = 0;     // 0 when no filter is kept
+      size_t bytes = 0;
+      uint64_t lookups = 0;        // finds and erases that asked the filter
+      uint64_t rejected = 0;       // answered without descending
+      uint64_t false_positives = 0;// let through, yet absent
+
+      //fraction of absent elements the filter let through
+      double false_positive_rate() const {
+         uint64_t absent = rejected + false_positives;
+         return absent != 0 ? static_cast<double>(false_positives) / absent : 0.0;
+      }
+   };
+
+  /**
+    * Keeps a blocked Bloom filter of the elements, so that find and
+    * erase of an absent element are usually answered without descending
+    * the tree.  Inserts add to the filter; erased elements linger in it
+    * until enough accumulate that it is rebuilt, as it is when the tree
+    * outgrows it.  Trees produced from this one (copies aside) start
+    * without a filter.  T must be hashable by std::hash.
+    *
+    * @param bitsPerKey filter bits per element it has room for; each
+    *        rebuild makes room for twice the elements present.
+    */
+   void enable_filter(size_t bitsPerKey = 10) {
+      static_assert(btree_hashable<T>::value, "a filtered btree needs std::hash<T>");
+      filter = std::make_unique<Filter>(bitsPerKey);
+      refilter();
+   }
+
+   void disable_filter() {
+      filter.reset();
+   }
+
+   filter_stats filter_statistics() const {
+      filter_stats stats;
+      if (filter != nullptr) {
+         stats.bits_per_key = filter->bitsPerKey;
+         stats.bytes = filter->bloom.size_bytes();
+         stats.lookups = filter->lookups.load(std::memory_order_relaxed);
+         stats.rejected = filter->rejected.load(std::memory_order_relaxed);
+         stats.false_positives = filter->falsePositives.load(std::memory_order_relaxed);
+      }
+      return stats;
+   }
+
+   struct checkpoint_progress {
+      bool running = false;
+      uint64_t elements = 0;       // elements written so far
+      uint64_t bytes = 0;          // snapshot bytes written so far
+      uint64_t nodes = 0;          // nodes captured by the checkpoint thread
+      uint64_t preimages = 0;      // nodes writers copied before changing them
+      size_t preimage_bytes = 0;   // memory held by copies not yet written
+      size_t preimage_peak = 0;
+      double seconds = 0;
+
+      double bytes_per_second() const {
+         return seconds > 0 ? bytes / seconds : 0;
+      }
+   };
+
+  /**
+    * Writes a snapshot of the btree as it stands now to path, in the
+    * save() format, on a background thread, while insert and erase carry
+    * on.  Before a writer changes a node the checkpoint has not reached
+    * yet, it copies the node's elements and child links; the checkpoint
+    * thread writes that copy instead of the live node, so the file holds
+    * exactly the elements present at the call.  Each node is copied at
+    * most once, and once the copies held exceed maxPreimageBytes writers
+    * wait for the checkpoint to catch up.
+    *
+    * Other operations that reshape the tree (split, merge, load,
+    * assignment, destruction) first wait for the checkpoint to finish.
+    * Elements must not be modified through iterators meanwhile.
+    *
+    * @param path the file to write; it is written under path + ".tmp"
+    *        and renamed into place once complete.
+    * @param maxPreimageBytes bound on the memory held by node copies.
+    * @throws whatever an earlier checkpoint failed with, if it did and
+    *         checkpoint_wait was not called.
+    */
+   void checkpoint_async(const std::string& path, size_t maxPreimageBytes = size_t(64) << 20) {
+      checkpoint_wait();
+      auto bg = std::make_unique<BackgroundCheckpoint>();
+      bg->epoch = ++checkpointEpoch();
+      bg->limit = maxPreimageBytes;
+      bg->progress.running = true;
+      bg->started = std::chrono::steady_clock::now();
+      bg->worker = std::thread(streamCheckpoint, std::ref(*bg), rootNode, path);
+      background = std::move(bg);
+   }
+
+  /**
+    * Progress of the current or last background checkpoint.
+    */
+   checkpoint_progress checkpoint_status() const {
+      if (background == nullptr) {
+         return checkpoint_progress();
+      }
+      std::lock_guard<std::mutex> lock{background->mutex};
+      checkpoint_progress progress = background->progress;
+      if (progress.running) {
+         progress.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                          background->started).count();
+      }
+      return progress;
+   }
+
+  /**
+    * Waits for a background checkpoint to finish.
+    *
+    * @throws whatever the checkpoint failed with, if it did.
+    */
+   void checkpoint_wait() {
+      settleCheckpoint();
+      if (background != nullptr && background->error) {
+         std::exception_ptr error;
+         std::swap(error, background->error);
+         std::rethrow_exception(error);
+      }
    }
 
   /**
@@ -260,41 +1101,50 @@ class btree {
     * Check that your implementation does not leak memory!
     */
   ~btree() {
+    settleCheckpoint();
     rootNode.reset();
   }
   
 private:
   struct Node {
+      //Nodes are made only through create: one cache-line-aligned block
+      //holds the shared_ptr control block with the node, then a cache
+      //line of its elements (when they can live there) and its child
+      //links, from tail on (see btree_block.h)
+      static std::shared_ptr<Node> create(Node *n, size_t size = 40) {
+         char* tail = nullptr;
+         return std::allocate_shared<Node>(btree_block_allocator<Node>(tailBytes(size), &tail), n, size);
+      }
+
+      static std::shared_ptr<Node> create(const Node& n) {
+         char* tail = nullptr;
+         return std::allocate_shared<Node>(btree_block_allocator<Node>(tailBytes(n.maxSize), &tail), n);
+      }
+
       //Default constructor for Node
-      Node(btree *b, Node *n, const size_t& size = 40): root{b}, parent{n}, children{size+1, nullptr}, maxSize{size} {
+      Node(char* tail, Node *n, const size_t& size = 40): maxSize{size}, children{tail + linksOffset(size), size+1}, parent{n} {
+         placeVal(tail);
       }
 
       //Copy constructor for node
-      Node(const Node& n): root{n.root}, parent{n.parent}, children{n.maxSize+1, nullptr}, maxSize{n.maxSize}, val{n.val} {
-         if (n.children.size() == 0) {
-            std::cout << "should never happen" << std::endl;
-            return;
-         }
+      Node(char* tail, const Node& n): maxSize{n.maxSize}, children{tail + linksOffset(n.maxSize), n.maxSize+1}, stem{n.stem}, prefixes{n.prefixes}, summary{n.summary}, parent{n.parent} {
+         placeVal(tail);
+         val = n.val;
          for (unsigned i = 0; i < n.children.size(); ++i) {
             if (n.children[i] != nullptr) {
-               children[i] = (std::make_shared<Node>(*n.children[i]));
+               children[i] = create(*n.children[i]);
             }
          }
-         
       }
 
-      //Important for copy/move semantics. Since root/parent are pointers, have to recursively update
-      //for the new btree
-      void changeRoot(btree* b) {
-         root = b;
-         for (unsigned i = 0; i < children.size(); ++i) {
-            if (children[i] != nullptr) {
-               children[i]->changeRoot(b);
-            }
+      ~Node() {
+         if (writtenBy != 0) {
+            btree_retired_nodes::retire(writtenBy, id);
          }
       }
 
-      //Same as above
+      //Important for copy semantics. Since parent is a pointer, have to recursively update
+      //for the new btree
       void changeParent(Node* n) {
          parent = n;
          for (unsigned i = 0; i < children.size(); ++i) {
@@ -304,54 +1154,276 @@ private:
          }
       } 
 
-      //Recursive helper for insert
-      std::pair<iterator, bool> nodeInsert(const T& elem) {
+      //Recursive helper for insert, copying or moving elem in
+      template <typename U>
+      std::pair<iterator, bool> nodeInsert(U&& elem) {
+         std::string_view key = keyOf(elem);
+         return nodeInsert(std::forward<U>(elem), key);
+      }
+
+      template <typename U>
+      std::pair<iterator, bool> nodeInsert(U&& elem, std::string_view key) {
          if (val.empty()) {
-            val.push_back(elem);
+            val.push_back(std::forward<U>(elem));
+            refreshPath();
             return std::pair<iterator, bool>(iterator(this, val.begin()), true);
          }
-         auto itPos = std::lower_bound(val.begin(), val.end(), elem);
-         auto pos = itPos - val.begin();
+         bool match;
+         auto pos = lowerBoundIn(elem, key, match);
+         auto itPos = val.begin() + pos;
 
-         if ((itPos != val.end()) && ((*itPos) == elem)) {
+         if (match) {
             return std::pair<iterator, bool>(iterator(this, itPos), false);
+         } else if (children[pos].get() != nullptr) {
+            return children[pos]->nodeInsert(std::forward<U>(elem), key);
          } else if (static_cast<unsigned>(val.size()) < maxSize) {
-            auto newIt = val.insert(itPos, elem);
+            //nodes reshaped by split/join may be part full and still have
+            //children, so the slots right of elem move along with it
+            std::move_backward(children.begin() + pos + 1, children.begin() + val.size() + 1,
+                               children.begin() + val.size() + 2);
+            auto newIt = val.insert(itPos, std::forward<U>(elem));
+            if constexpr (btree_prefixed<T>::value) {
+               //only an element outside the stem makes reindex start over
+               if (hasStem(key)) {
+                  prefixes.insert(prefixes.begin() + pos, btree_key_prefix(key.data(), key.size(), stem.size()));
+               }
+            }
+            refreshPath();
             return std::pair<iterator, bool>(iterator(this, newIt), true);
-         } else if (children[pos].get() != nullptr) {
-            return children[pos]->nodeInsert(elem);
          } else {
-            children[pos] = std::make_shared<Node>(root, this, maxSize);
-            return children[pos]->nodeInsert(elem);
+            children[pos] = Node::create(this, maxSize);
+            touch();
+            return children[pos]->nodeInsert(std::forward<U>(elem), key);
          }
       }
       
 
-    //Recursive helper function for find
-    iterator nodeFind(const T& elem) {
-      auto itPos = std::lower_bound(val.begin(), val.end(), elem);
-      auto pos = itPos - val.begin();
+    //Recursive helper function for find. Returns the node holding elem
+    //with pos set to its index, or nullptr if elem is not in the subtree
+    Node* nodeFind(const T& elem, size_t& pos) {
+      return nodeFind(elem, keyOf(elem), pos);
+    }
+
+    Node* nodeFind(const T& elem, std::string_view key, size_t& pos) {
+      bool match;
+      pos = lowerBoundIn(elem, key, match);
 
-      if ((*itPos) == elem) {
-        return iterator(this, itPos);
+      if (match) {
+        return this;
       } else if (children[pos].get() != nullptr) {            
-        return children[pos]->nodeFind(elem);
+        return children[pos]->nodeFind(elem, key, pos);
+      }
+      return nullptr;
+    }
+
+    //Recursive helper function for lower_bound. The answer is the element
+    //the search stops at in the deepest node where it stops short of the
+    //end; nullptr means every element is less than elem
+    Node* nodeLowerBound(const T& elem, size_t& pos) {
+      return nodeLowerBound(elem, keyOf(elem), pos);
+    }
+
+    Node* nodeLowerBound(const T& elem, std::string_view key, size_t& pos) {
+      bool match;
+      size_t here = lowerBoundIn(elem, key, match);
+
+      if (!match && children[here] != nullptr) {
+        Node* below = children[here]->nodeLowerBound(elem, key, pos);
+        if (below != nullptr) {
+          return below;
+        }
+      }
+      pos = here;
+      return here < val.size() ? this : nullptr;
+    }
+
+    //elem's key encoding, or nothing where elements have no key
+    //prefixes. A descent encodes its element once, into a buffer reused
+    //by the thread's next call
+    static std::string_view keyOf(const T& elem) {
+      if constexpr (btree_prefixed<T>::value) {
+        thread_local std::string bytes;
+        bytes.clear();
+        btree_key_encoder<T>::encode(elem, bytes);
+        return bytes;
+      } else {
+        (void)elem;
+        return std::string_view();
+      }
+    }
+
+    //Whether an element encoded as key begins with this node's stem
+    bool hasStem(std::string_view key) const {
+      return key.compare(0, stem.size(), stem) == 0;
+    }
+
+    //Index of the first element not less than elem, whose keyOf is key.
+    //Where elements have key prefixes, an element outside the stem they
+    //share goes before or after all of them; otherwise binary search
+    //compares the prefixes of what follows the stem, and only the
+    //elements sharing elem's prefix are compared themselves
+    size_t lowerBoundIn(const T& elem) const {
+      bool match;
+      return lowerBoundIn(elem, keyOf(elem), match);
+    }
+
+    //As above, also setting match to whether the element found is elem.
+    //With key prefixes that is only checked if the prefixes are equal,
+    //so an element elsewhere in memory is not read just to rule it out
+    size_t lowerBoundIn(const T& elem, std::string_view key, bool& match) const {
+      if constexpr (btree_prefixed<T>::value) {
+        match = false;
+        int order = key.compare(0, stem.size(), stem);
+        if (order != 0) {
+          return order < 0 ? 0 : val.size();
+        }
+        uint64_t window = btree_key_prefix(key.data(), key.size(), stem.size());
+        size_t lo = std::lower_bound(prefixes.begin(), prefixes.end(), window) - prefixes.begin();
+        size_t hi = lo;
+        while (hi < prefixes.size() && prefixes[hi] == window) {
+          ++hi;
+        }
+        size_t pos = std::lower_bound(val.begin() + lo, val.begin() + hi, elem) - val.begin();
+        match = pos < hi && val[pos] == elem;
+        return pos;
+      } else {
+        (void)key;
+        size_t pos = std::lower_bound(val.begin(), val.end(), elem) - val.begin();
+        match = pos < val.size() && val[pos] == elem;
+        return pos;
+      }
+    }
+
+    //Recomputes the stem and key prefixes after elements were added or
+    //removed. One added along with its prefix, removed along with it
+    //(unprefix), or replaced in place (which must then call reprefix),
+    //leaves nothing to do
+    void reindex() {
+      if constexpr (btree_prefixed<T>::value) {
+        if (prefixes.size() == val.size()) {
+          return;
+        }
+        //the elements are sorted, so the first and last share the least
+        stem.clear();
+        if (!val.empty()) {
+          std::string last;
+          btree_key_encoder<T>::encode(val.front(), stem);
+          btree_key_encoder<T>::encode(val.back(), last);
+          stem.resize(std::mismatch(stem.begin(), stem.end(), last.begin(), last.end()).first - stem.begin());
+        }
+        prefixes.resize(val.size());
+        for (size_t i = 0; i < val.size(); ++i) {
+          prefixes[i] = btree_key_prefix(val[i], stem.size());
+        }
+      }
+    }
+
+    void reprefix(size_t i) {
+      if constexpr (btree_prefixed<T>::value) {
+        std::string key;
+        btree_key_encoder<T>::encode(val[i], key);
+        if (hasStem(key)) {
+          prefixes[i] = btree_key_prefix(key.data(), key.size(), stem.size());
+        } else {
+          prefixes.clear();
+          reindex();
+        }
+      }
+    }
+
+    //Drops the prefix of the element just erased from i, if the two
+    //were in step. The stem, common to the rest still, stays: it may
+    //then be shorter than the elements share, which costs a little
+    //search but no correctness
+    void unprefix(size_t i) {
+      if constexpr (btree_prefixed<T>::value) {
+        if (prefixes.size() == val.size() + 1) {
+          prefixes.erase(prefixes.begin() + i);
+        }
       }
-        return root->end();
-    }    
+    }
+
+    //Marks this node as changed since the last checkpoint
+    void touch() {
+      dirty = true;
+    }
+
+    //Called on a node whose elements or children changed: marks it dirty
+    //and recomputes its key prefixes and cached summary
+    void refresh() {
+      touch();
+      reindex();
+      summarise();
+    }
 
-    //Recursive helper function for const find
-    const_iterator cNodeFind(const T& elem) {
-      auto itPos = std::lower_bound(val.begin(), val.end(), elem);
-      auto pos = itPos - val.begin();
+    //Recomputes the cached summary from the elements and the children's
+    //summaries. Does nothing for a btree without an Augment
+    void summarise() {
+      if constexpr (!std::is_void<Augment>::value) {
+        auto acc = Augment::identity();
+        for (size_t i = 0; i < val.size(); ++i) {
+          if (children[i] != nullptr) {
+            acc = Augment::combine(acc, children[i]->summary);
+          }
+          acc = Augment::combine(acc, Augment::lift(val[i]));
+        }
+        if (children[val.size()] != nullptr) {
+          acc = Augment::combine(acc, children[val.size()]->summary);
+        }
+        summary = std::move(acc);
+      }
+    }
+
+    //Refreshes this node after a change here, and brings its ancestors'
+    //summaries up to date. The ancestors are flagged dirtyBelow so a
+    //checkpoint finds this node; without an Augment the climb stops at
+    //the first ancestor already flagged
+    void refreshPath() {
+      refresh();
+      for (Node* node = parent; node != nullptr; node = node->parent) {
+        if (std::is_void<Augment>::value && node->dirtyBelow) {
+          break;
+        }
+        node->dirtyBelow = true;
+        node->summarise();
+      }
+    }
+
+    //Recursive helper for aggregate. A null bound is open; with both
+    //open the cached summary answers directly
+    summary_type aggregate(const T* lo, const T* hi) const {
+      if (lo == nullptr && hi == nullptr) {
+        return summary;
+      }
+      size_t start = lo ? lowerBoundIn(*lo) : 0;
+      size_t stop = hi ? lowerBoundIn(*hi) : val.size();
+      if (start == stop) {
+        return children[start] ? children[start]->aggregate(lo, hi) : Augment::identity();
+      }
 
-      if ((*itPos) == elem) {
-        return const_iterator(this, itPos);
-      } else if (children[pos].get() != nullptr) {
-        return children[pos]->cNodeFind(elem);
+      auto acc = children[start] ? children[start]->aggregate(lo, nullptr) : Augment::identity();
+      for (size_t i = start; i < stop; ++i) {
+        acc = Augment::combine(acc, Augment::lift(val[i]));
+        if (children[i + 1] != nullptr) {
+          acc = Augment::combine(acc, i + 1 == stop ? children[i + 1]->aggregate(nullptr, hi)
+                                                    : children[i + 1]->summary);
+        }
       }
+      return acc;
+    }
 
-      return root->cend();
+    //In-order visit of every element in this subtree
+    template <typename Function>
+    void visit(Function&& fn) const {
+      for (size_t i = 0; i < val.size(); ++i) {
+        if (children[i] != nullptr) {
+          children[i]->visit(fn);
+        }
+        fn(val[i]);
+      }
+      if (children[val.size()] != nullptr) {
+        children[val.size()]->visit(fn);
+      }
     }
 
     //Recursive function for begin()
@@ -391,16 +1463,926 @@ private:
         }
     }
      
-    btree *root;
-    Node *parent;
-    std::vector<std::shared_ptr<Node>> children;
+    //A raw buffer of elements goes in the block, ahead of the links
+    static constexpr bool valInBlock = std::is_same<btree_elements<T>, btree_buffer<T>>::value &&
+                                       alignof(T) <= btree_line_bytes;
+
+    //Elements kept in the block. Most nodes hold few, and a bigger block
+    //costs more to allocate and free than a fuller node spilling its
+    //elements to the heap does
+    static size_t inlineElems(size_t size) {
+       return valInBlock ? std::min(size, std::max<size_t>(1, btree_line_bytes / sizeof(T))) : 0;
+    }
+
+    static size_t linksOffset(size_t size) {
+       size_t elems = inlineElems(size) * sizeof(T);
+       size_t align = alignof(std::shared_ptr<Node>);
+       return (elems + align - 1) / align * align;
+    }
+
+    static size_t tailBytes(size_t size) {
+       return linksOffset(size) + (size + 1) * sizeof(std::shared_ptr<Node>);
+    }
+
+    void placeVal(char* tail) {
+       if constexpr (valInBlock) {
+          val.place(reinterpret_cast<T*>(tail), inlineElems(maxSize));
+       }
+    }
+
+    //Hot fields first: a descent reads the element count and elements,
+    //then one child link
     const size_t maxSize;
-    std::vector<T> val;
+    //sorted; in slots for large elements and a raw buffer for trivially
+    //copyable ones (see btree_slots.h, btree_buffer.h)
+    btree_elements<T> val;
+    //maxSize + 1 of them, in the node's block
+    btree_links<std::shared_ptr<Node>> children;
+    //When btree_prefixed<T>: the encoded bytes every element begins
+    //with, stored once, and the key prefix of what follows it in each
+    //element. Kept in step with val by refresh and reprefix
+    std::string stem;
+    std::vector<uint64_t> prefixes;
+    summary_type summary;
+    Node *parent;
+
+    //Checkpoint state: the node's id in the file holding token writtenBy
+    //(0 if never written), whether it changed since, and whether anything
+    //below it did
+    uint64_t id = 0;
+    uint64_t writtenBy = 0;
+    bool dirty = true;
+    bool dirtyBelow = false;
+
+    //The latest background checkpoint that has this node's contents in
+    //hand (or that started after the node was created)
+    uint64_t snapshotEpoch = checkpointEpoch().load();
+  };
+
+
+  using NodePtr = std::shared_ptr<Node>;
+
+  //Snapshot format: magic, version, element count and node capacity,
+  //then blocks of [count][payload bytes][payload][crc32 of payload],
+  //ending with an empty block
+  static constexpr const char* snapshotMagic = "BTRE";
+  static constexpr uint32_t snapshotVersion = 1;
+  static constexpr size_t snapshotBlockElems = 4096;
+  //Largest node capacity load accepts from a snapshot header
+  static constexpr size_t snapshotMaxNodeElems = size_t{1} << 20;
+
+  //Reads a block of the given size into block a chunk at a time, so a
+  //corrupt length runs into the end of the stream before it can ask for
+  //much memory
+  static void readSnapshotBlock(std::istream& is, std::string& block, size_t size) {
+     const size_t chunk = size_t{1} << 20;
+     block.clear();
+     while (block.size() < size) {
+        size_t done = block.size();
+        block.resize(done + std::min(chunk, size - done));
+        if (!is.read(&block[done], block.size() - done)) {
+           throw std::runtime_error("btree::load: truncated snapshot");
+        }
+     }
+  }
+
+  //Batches elements into checksummed blocks for save
+  struct SnapshotWriter {
+     explicit SnapshotWriter(std::ostream& o): os{o} {}
+
+     std::ostream& os;
+     std::string payload;
+     std::string frame;
+     uint32_t n = 0;
+     const T* prev = nullptr;
+     uint64_t bytes = 0;
+
+     //Keep a copy of the previous element rather than pointing at it
+     bool copyPrev = false;
+     std::optional<T> held;
+
+     //elem must stay alive until the next call, unless copyPrev is set
+     void add(const T& elem) {
+        btree_codec<T>::encode(payload, elem, n == 0 ? nullptr : prev);
+        if (copyPrev) {
+           held = elem;
+           prev = &*held;
+        } else {
+           prev = &elem;
+        }
+        if (++n == snapshotBlockElems) {
+           flush();
+        }
+     }
+
+     void flush() {
+        if (n == 0) {
+           return;
+        }
+        frame.clear();
+        btree_bytes::putFixed<uint32_t>(frame, n);
+        btree_bytes::putFixed<uint32_t>(frame, static_cast<uint32_t>(payload.size()));
+        os.write(frame.data(), frame.size());
+        os.write(payload.data(), payload.size());
+        frame.clear();
+        btree_bytes::putFixed<uint32_t>(frame, btree_crc32(payload.data(), payload.size()));
+        os.write(frame.data(), frame.size());
+        bytes += 12 + payload.size();
+        payload.clear();
+        n = 0;
+     }
+
+     void finish() {
+        frame.clear();
+        btree_bytes::putFixed<uint32_t>(frame, 0);
+        btree_bytes::putFixed<uint32_t>(frame, 0);
+        os.write(frame.data(), frame.size());
+        bytes += frame.size();
+     }
   };
 
+  //A node's elements and child links as a background checkpoint sees them
+  struct Capture {
+     std::vector<T> val;
+     std::vector<NodePtr> children;
+
+     size_t bytes() const {
+        return sizeof(Capture) + val.size() * sizeof(T) + children.size() * sizeof(NodePtr);
+     }
+  };
+
+  //Shared between the writer and the checkpoint thread; everything but
+  //active is guarded by mutex
+  struct BackgroundCheckpoint {
+     std::mutex mutex;
+     std::condition_variable drained;
+     std::unordered_map<const Node*, Capture> preimages;
+     uint64_t epoch = 0;
+     size_t limit = 0;
+     std::atomic<bool> active{true};
+     checkpoint_progress progress;
+     std::chrono::steady_clock::time_point started;
+     std::exception_ptr error;
+     std::thread worker;
+  };
+
+  //Background checkpoints are numbered from here. Nodes created after a
+  //checkpoint starts take its number and so are never captured by it
+  static std::atomic<uint64_t>& checkpointEpoch() {
+     static std::atomic<uint64_t> epoch{0};
+     return epoch;
+  }
+
+  //Joins a finished or running checkpoint thread, leaving any error for
+  //checkpoint_wait
+  void settleCheckpoint() {
+     if (background != nullptr && background->worker.joinable()) {
+        background->worker.join();
+     }
+  }
+
+  //Called by insert and erase before they change anything. While a
+  //background checkpoint runs, copies each node on elem's search path
+  //that the checkpoint has yet to capture, and for an erase the spine
+  //below elem that refills its slot. The lock returned keeps the
+  //checkpoint thread out until the change is complete
+  std::unique_lock<std::mutex> preserveFor(const T& elem, bool erasing) {
+     if (background == nullptr || !background->active) {
+        return std::unique_lock<std::mutex>();
+     }
+     BackgroundCheckpoint& bg = *background;
+     std::unique_lock<std::mutex> lock{bg.mutex};
+     bg.drained.wait(lock, [&bg] { return !bg.active || bg.progress.preimage_bytes < bg.limit; });
+     if (!bg.active) {
+        return std::unique_lock<std::mutex>();
+     }
+
+     Node* node = rootNode.get();
+     for (;;) {
+        preserve(bg, node);
+        size_t pos = node->lowerBoundIn(elem);
+        auto itPos = node->val.begin() + pos;
+        if (itPos != node->val.end() && *itPos == elem) {
+           if (erasing && node->children[pos] != nullptr) {
+              for (Node* c = node->children[pos].get(); c != nullptr; c = c->children[c->val.size()].get()) {
+                 preserve(bg, c);
+              }
+           } else if (erasing) {
+              for (Node* c = node->children[pos + 1].get(); c != nullptr; c = c->children[0].get()) {
+                 preserve(bg, c);
+              }
+           }
+           break;
+        } else if (node->children[pos] == nullptr) {
+           break;
+        }
+        node = node->children[pos].get();
+     }
+     return lock;
+  }
+
+  static void preserve(BackgroundCheckpoint& bg, Node* node) {
+     if (node->snapshotEpoch >= bg.epoch) {
+        return;
+     }
+     node->snapshotEpoch = bg.epoch;
+     Capture copy{std::vector<T>(node->val.begin(), node->val.end()),
+                  std::vector<NodePtr>(node->children.begin(), node->children.begin() + node->val.size() + 1)};
+     bg.progress.preimage_bytes += copy.bytes();
+     bg.progress.preimage_peak = std::max(bg.progress.preimage_peak, bg.progress.preimage_bytes);
+     ++bg.progress.preimages;
+     bg.preimages.emplace(node, std::move(copy));
+  }
+
+  //The checkpoint thread's view of node: the copy a writer made, or
+  //else the live node, which no writer has changed since the start
+  static Capture capture(BackgroundCheckpoint& bg, Node* node, const SnapshotWriter& writer) {
+     std::lock_guard<std::mutex> lock{bg.mutex};
+     ++bg.progress.nodes;
+     bg.progress.bytes = writer.bytes;
+     auto found = bg.preimages.find(node);
+     if (found != bg.preimages.end()) {
+        Capture copy = std::move(found->second);
+        bg.preimages.erase(found);
+        bg.progress.preimage_bytes -= copy.bytes();
+        bg.drained.notify_all();
+        return copy;
+     }
+     node->snapshotEpoch = bg.epoch;
+     return Capture{std::vector<T>(node->val.begin(), node->val.end()),
+                    std::vector<NodePtr>(node->children.begin(), node->children.begin() + node->val.size() + 1)};
+  }
+
+  static void streamNode(BackgroundCheckpoint& bg, Node* node, SnapshotWriter& writer, uint64_t& count) {
+     Capture view = capture(bg, node, writer);
+     for (size_t i = 0; i <= view.val.size(); ++i) {
+        if (view.children[i] != nullptr) {
+           streamNode(bg, view.children[i].get(), writer, count);
+        }
+        if (i < view.val.size()) {
+           writer.add(view.val[i]);
+           ++count;
+        }
+     }
+     std::lock_guard<std::mutex> lock{bg.mutex};
+     bg.progress.elements = count;
+  }
+
+  //Body of the checkpoint thread. The element count is not known until
+  //the end, so the header is patched once the elements are out
+  static void streamCheckpoint(BackgroundCheckpoint& bg, NodePtr root, std::string path) {
+     try {
+        std::string tmp = path + ".tmp";
+        std::ofstream os{tmp, std::ios::binary | std::ios::trunc};
+        std::string header(snapshotMagic, 4);
+        btree_bytes::putFixed<uint32_t>(header, snapshotVersion);
+        btree_bytes::putFixed<uint64_t>(header, 0);
+        btree_bytes::putFixed<uint32_t>(header, static_cast<uint32_t>(root->maxSize));
+        os.write(header.data(), header.size());
+
+        SnapshotWriter writer{os};
+        writer.copyPrev = true;
+        uint64_t count = 0;
+        streamNode(bg, root.get(), writer, count);
+        writer.flush();
+        writer.finish();
+
+        std::string patch;
+        btree_bytes::putFixed<uint64_t>(patch, count);
+        os.seekp(8);
+        os.write(patch.data(), patch.size());
+        os.close();
+        if (!os) {
+           throw std::runtime_error("btree::checkpoint_async: cannot write " + tmp);
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+           throw std::runtime_error("btree::checkpoint_async: cannot rename " + tmp);
+        }
+        root.reset();
+
+        std::lock_guard<std::mutex> lock{bg.mutex};
+        bg.progress.bytes = writer.bytes + header.size();
+     } catch (...) {
+        std::lock_guard<std::mutex> lock{bg.mutex};
+        bg.error = std::current_exception();
+     }
+     std::lock_guard<std::mutex> lock{bg.mutex};
+     bg.active = false;
+     bg.preimages.clear();
+     bg.progress.preimage_bytes = 0;
+     bg.progress.running = false;
+     bg.progress.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                         bg.started).count();
+     bg.drained.notify_all();
+  }
+
+  enum class SetOp { unite, intersect, subtract };
+
+  //Hands the root over to the split/join helpers, which treat an empty
+  //tree as a null subtree. restoreRoot puts an empty node back if needed
+  NodePtr takeRoot() {
+     NodePtr root = std::move(rootNode);
+     if (root->val.empty()) {
+        root = nullptr;
+     }
+     return root;
+  }
+
+  void restoreRoot(size_t maxSize) {
+     if (rootNode == nullptr) {
+        rootNode = Node::create(nullptr, maxSize);
+     }
+     rootNode->parent = nullptr;
+  }
+
+  static btree<T, Augment> fromRoot(NodePtr root, size_t maxSize) {
+     btree<T, Augment> tree(maxSize);
+     if (root != nullptr) {
+        tree.rootNode = std::move(root);
+        tree.rootNode->parent = nullptr;
+     }
+     return tree;
+  }
+
+  static void attach(Node* parent, size_t i, NodePtr child) {
+     if (child != nullptr) {
+        child->parent = parent;
+     }
+     parent->children[i] = std::move(child);
+  }
+
+  //Cuts the subtree at node into the elements less than key and those
+  //greater than key. An element equal to key is moved into match.
+  //Nodes emptied by the cut collapse into their only child
+  static std::pair<NodePtr, NodePtr> splitNode(NodePtr node, const T& key, std::optional<T>& match) {
+     if (node == nullptr) {
+        return {nullptr, nullptr};
+     }
+     size_t pos = node->lowerBoundIn(key);
+     auto itPos = node->val.begin() + pos;
+     size_t size = node->val.size();
+
+     NodePtr lower, upper;
+     size_t from = pos;
+     if ((itPos != node->val.end()) && ((*itPos) == key)) {
+        match.emplace(std::move(*itPos));
+        lower = std::move(node->children[pos]);
+        upper = std::move(node->children[pos + 1]);
+        from = pos + 1;
+     } else {
+        std::tie(lower, upper) = splitNode(std::move(node->children[pos]), key, match);
+     }
+
+     auto right = Node::create(nullptr, node->maxSize);
+     attach(right.get(), 0, std::move(upper));
+     for (size_t i = from; i < size; ++i) {
+        right->val.push_back(std::move(node->val[i]));
+        attach(right.get(), i - from + 1, std::move(node->children[i + 1]));
+     }
+     node->val.erase(node->val.begin() + pos, node->val.end());
+     attach(node.get(), pos, std::move(lower));
+     node->refresh();
+     right->refresh();
+
+     auto collapse = [](NodePtr piece) {
+        if (piece->val.empty()) {
+           piece = std::move(piece->children[0]);
+        }
+        if (piece != nullptr) {
+           piece->parent = nullptr;
+        }
+        return piece;
+     };
+     return {collapse(std::move(node)), collapse(std::move(right))};
+  }
+
+  //Joins two subtrees around x, everything in left being less than x
+  //and everything in right greater. Whichever root has room takes x and
+  //the other subtree, so the result is at most one level deeper
+  static NodePtr joinNodes(NodePtr left, T x, NodePtr right, size_t maxSize) {
+     if (left == nullptr && right == nullptr) {
+        auto node = Node::create(nullptr, maxSize);
+        node->val.push_back(std::move(x));
+        node->refresh();
+        return node;
+     } else if (left == nullptr) {
+        right->nodeInsert(std::move(x));
+        return right;
+     } else if (right == nullptr) {
+        left->nodeInsert(std::move(x));
+        return left;
+     } else if (left->val.size() < left->maxSize) {
+        left->val.push_back(std::move(x));
+        attach(left.get(), left->val.size(), std::move(right));
+        left->refresh();
+        return left;
+     } else if (right->val.size() < right->maxSize) {
+        std::move_backward(right->children.begin(), right->children.begin() + right->val.size() + 1,
+                           right->children.begin() + right->val.size() + 2);
+        right->val.insert(right->val.begin(), std::move(x));
+        attach(right.get(), 0, std::move(left));
+        right->refresh();
+        return right;
+     }
+     auto node = Node::create(nullptr, maxSize);
+     node->val.push_back(std::move(x));
+     attach(node.get(), 0, std::move(left));
+     attach(node.get(), 1, std::move(right));
+     node->refresh();
+     return node;
+  }
+
+  //Joins two subtrees with no element between them, borrowing the
+  //largest element of left as the pivot
+  static NodePtr joinNodes(NodePtr left, NodePtr right) {
+     if (left == nullptr) {
+        return right;
+     } else if (right == nullptr) {
+        return left;
+     }
+     size_t maxSize = left->maxSize;
+     Node* lowest;
+     T x = popMax(left, nullptr, lowest);
+     if (lowest != nullptr) {
+        lowest->refreshPath();
+     }
+     return joinNodes(std::move(left), std::move(x), std::move(right), maxSize);
+  }
+
+  //Removes the largest element of the subtree held in slot, which hangs
+  //off owner. The node it came from is replaced by its remaining child
+  //once it runs empty. lowest is set to the deepest node whose summary
+  //is now stale
+  static T popMax(NodePtr& slot, Node* owner, Node*& lowest) {
+     Node* node = slot.get();
+     while (node->children[node->val.size()] != nullptr) {
+        node = node->children[node->val.size()].get();
+     }
+     T x = std::move(node->val.back());
+     node->val.pop_back();
+     node->unprefix(node->val.size());
+     lowest = node;
+     if (node->val.empty()) {
+        lowest = node == slot.get() ? owner : node->parent;
+        NodePtr child = std::move(node->children[0]);
+        if (node == slot.get()) {
+           slot = std::move(child);
+           if (slot != nullptr) {
+              slot->parent = owner;
+           }
+        } else {
+           Node* parent = node->parent;
+           attach(parent, parent->val.size(), std::move(child));
+        }
+     }
+     return x;
+  }
+
+  //Mirror image of popMax
+  static T popMin(NodePtr& slot, Node* owner, Node*& lowest) {
+     Node* node = slot.get();
+     while (node->children[0] != nullptr) {
+        node = node->children[0].get();
+     }
+     T x = std::move(node->val.front());
+     node->val.erase(node->val.begin());
+     node->unprefix(0);
+     std::move(node->children.begin() + 1, node->children.begin() + node->val.size() + 2,
+               node->children.begin());
+     lowest = node;
+     if (node->val.empty()) {
+        lowest = node == slot.get() ? owner : node->parent;
+        NodePtr child = std::move(node->children[0]);
+        if (node == slot.get()) {
+           slot = std::move(child);
+           if (slot != nullptr) {
+              slot->parent = owner;
+           }
+        } else {
+           attach(node->parent, 0, std::move(child));
+        }
+     }
+     return x;
+  }
+
+  //Removes and returns the element at pos in node. The gap is filled
+  //from the neighbouring subtrees where there are any; otherwise the
+  //two empty slots either side close up, and a non-root node left with
+  //nothing in it is unlinked from its parent
+  static T eraseAt(Node* node, size_t pos) {
+     T x = std::move(node->val[pos]);
+     Node* lowest = node;
+     node->touch();
+     if (node->children[pos] != nullptr) {
+        node->val[pos] = popMax(node->children[pos], node, lowest);
+        node->reprefix(pos);
+     } else if (node->children[pos + 1] != nullptr) {
+        node->val[pos] = popMin(node->children[pos + 1], node, lowest);
+        node->reprefix(pos);
+     } else {
+        size_t size = node->val.size();
+        node->val.erase(node->val.begin() + pos);
+        node->unprefix(pos);
+        std::move(node->children.begin() + pos + 2, node->children.begin() + size + 1,
+                  node->children.begin() + pos + 1);
+        if (node->val.empty() && node->parent != nullptr) {
+           auto& siblings = node->parent->children;
+           lowest = node->parent;
+           std::find_if(siblings.begin(), siblings.end(),
+                        [node](const NodePtr& c) { return c.get() == node; })->reset();
+        }
+     }
+     lowest->refreshPath();
+     return x;
+  }
+
+  //Distributes the subtree src over the slots of node: a run of src
+  //elements landing in an empty slot is linked in as a whole, the rest
+  //recurse into the child already there. Elements node's subtree
+  //already holds are collected, in order, in clashes
+  static void mergeInto(Node* node, NodePtr src, NodePtr& clashes) {
+     size_t size = node->val.size();
+     for (size_t i = 0; i <= size && src != nullptr; ++i) {
+        NodePtr piece;
+        std::optional<T> match;
+        if (i < size) {
+           std::tie(piece, src) = splitNode(std::move(src), node->val[i], match);
+        } else {
+           piece = std::move(src);
+        }
+        if (piece != nullptr) {
+           if (node->children[i] == nullptr) {
+              attach(node, i, std::move(piece));
+           } else {
+              mergeInto(node->children[i].get(), std::move(piece), clashes);
+           }
+        }
+        if (match) {
+           clashes = joinNodes(std::move(clashes), std::move(*match), nullptr, node->maxSize);
+        }
+     }
+     node->refresh();
+  }
+
+  static btree<T, Augment> setAlgebra(btree<T, Augment> a, btree<T, Augment> b, SetOp op, size_t threads) {
+     size_t maxSize = a.rootNode->maxSize;
+     return fromRoot(combine(a.takeRoot(), b.takeRoot(), op, threads), maxSize);
+  }
+
+  //Recursion behind the set algorithms: b is split around the elements
+  //of a's root, each piece is combined with the matching child of a, and
+  //the results are stitched back around the elements of a that survive
+  static NodePtr combine(NodePtr a, NodePtr b, SetOp op, size_t threads) {
+     if (a == nullptr) {
+        return op == SetOp::unite ? b : nullptr;
+     } else if (b == nullptr) {
+        return op == SetOp::intersect ? nullptr : a;
+     }
+
+     size_t size = a->val.size();
+     std::vector<NodePtr> pieces(size + 1);
+     std::vector<bool> keep(size);
+     bool keepAll = true;
+     for (size_t i = 0; i < size; ++i) {
+        std::optional<T> match;
+        std::tie(pieces[i], b) = splitNode(std::move(b), a->val[i], match);
+        keep[i] = op == SetOp::unite || (op == SetOp::intersect) == match.has_value();
+        keepAll = keepAll && keep[i];
+     }
+     pieces[size] = std::move(b);
+
+     size_t childThreads = std::max<size_t>(1, threads / (size + 1));
+     runTasks(threads, size + 1, [&](size_t i) {
+        NodePtr child = std::move(a->children[i]);
+        if (child != nullptr) {
+           child->parent = nullptr;
+        }
+        pieces[i] = combine(std::move(child), std::move(pieces[i]), op, childThreads);
+     });
+
+     if (keepAll) {
+        for (size_t i = 0; i <= size; ++i) {
+           attach(a.get(), i, std::move(pieces[i]));
+        }
+        a->refresh();
+        return a;
+     }
+     NodePtr result = std::move(pieces[0]);
+     for (size_t i = 0; i < size; ++i) {
+        if (keep[i]) {
+           result = joinNodes(std::move(result), std::move(a->val[i]), std::move(pieces[i + 1]), a->maxSize);
+        } else {
+           result = joinNodes(std::move(result), std::move(pieces[i + 1]));
+        }
+     }
+     return result;
+  }
+
+  //Splits the tree into independent subtrees for the parallel
+  //algorithms, expanding level by level until there are a few tasks per
+  //thread.  Elements of the expanded nodes are collected in top.
+  std::vector<const Node*> partition(size_t threads, std::vector<const T*>& top) const {
+     std::vector<const Node*> frontier{rootNode.get()};
+     while (frontier.size() < 4 * threads) {
+        std::vector<const Node*> next;
+        for (auto node : frontier) {
+           for (size_t i = 0; i < node->val.size(); ++i) {
+              top.push_back(&node->val[i]);
+           }
+           for (auto& child : node->children) {
+              if (child != nullptr) {
+                 next.push_back(child.get());
+              }
+           }
+        }
+        frontier = std::move(next);
+        if (frontier.empty()) {
+           break;
+        }
+     }
+     return frontier;
+  }
+
+  //Runs work(0) .. work(count - 1) on up to threads workers, each
+  //worker claiming the next unstarted index until all are done
+  template <typename Work>
+  static void runTasks(size_t threads, size_t count, Work work) {
+     size_t workerCount = std::max<size_t>(1, std::min(threads, count));
+     if (workerCount == 1) {
+        for (size_t i = 0; i < count; ++i) {
+           work(i);
+        }
+        return;
+     }
+     std::atomic<size_t> next{0};
+     std::vector<std::thread> workers;
+     for (size_t w = 0; w < workerCount; ++w) {
+        workers.emplace_back([&] {
+           for (size_t i = next++; i < count; i = next++) {
+              work(i);
+           }
+        });
+     }
+     for (auto& w : workers) {
+        w.join();
+     }
+  }
+
+  //Sorts elems on up to threads workers: each sorts a contiguous chunk,
+  //then neighbouring runs are merged pairwise until one run is left
+  static void parallelSort(std::vector<T>& elems, size_t threads) {
+     size_t chunks = std::max<size_t>(1, std::min(threads, elems.size() / 4096));
+     if (chunks == 1) {
+        std::sort(elems.begin(), elems.end());
+        return;
+     }
+
+     std::vector<size_t> bounds;
+     for (size_t i = 0; i <= chunks; ++i) {
+        bounds.push_back(elems.size() * i / chunks);
+     }
+     std::vector<std::thread> workers;
+     for (size_t i = 0; i < chunks; ++i) {
+        workers.emplace_back([&elems, &bounds, i] {
+           std::sort(elems.begin() + bounds[i], elems.begin() + bounds[i + 1]);
+        });
+     }
+     for (auto& w : workers) {
+        w.join();
+     }
+
+     for (size_t width = 1; width < chunks; width *= 2) {
+        workers.clear();
+        for (size_t i = 0; i + width < chunks; i += 2 * width) {
+           size_t hi = std::min(i + 2 * width, chunks);
+           workers.emplace_back([&elems, &bounds, i, width, hi] {
+              std::inplace_merge(elems.begin() + bounds[i],
+                                 elems.begin() + bounds[i + width],
+                                 elems.begin() + bounds[hi]);
+           });
+        }
+        for (auto& w : workers) {
+           w.join();
+        }
+     }
+  }
+
+  //Lays the n sorted, distinct elements at first out as a subtree.
+  //A node that cannot hold everything takes maxSize evenly spaced
+  //separators and spreads the rest evenly over its maxSize+1 children,
+  //so every internal node is full and all leaves sit at similar depth.
+  //Children are handed out round-robin to the available threads.
+  static std::shared_ptr<Node> buildNode(const T* first, size_t n, Node* parent,
+                                         size_t maxSize, size_t threads) {
+     auto node = Node::create(parent, maxSize);
+     if (n <= maxSize) {
+        node->val.assign(first, first + n);
+        node->refresh();
+        return node;
+     }
+
+     size_t rest = n - maxSize;
+     std::vector<const T*> starts;
+     std::vector<size_t> counts;
+     const T* cur = first;
+     for (size_t i = 0; i <= maxSize; ++i) {
+        size_t count = rest / (maxSize + 1) + (i < rest % (maxSize + 1) ? 1 : 0);
+        starts.push_back(cur);
+        counts.push_back(count);
+        cur += count;
+        if (i < maxSize) {
+           node->val.push_back(*cur++);
+        }
+     }
+
+     auto buildChild = [&](size_t i, size_t childThreads) {
+        if (counts[i] != 0) {
+           node->children[i] = buildNode(starts[i], counts[i], node.get(),
+                                         maxSize, childThreads);
+        }
+     };
+     if (threads <= 1 || n < 65536) {
+        for (size_t i = 0; i <= maxSize; ++i) {
+           buildChild(i, 1);
+        }
+     } else {
+        size_t workerCount = std::min(threads, maxSize + 1);
+        size_t childThreads = std::max<size_t>(1, threads / (maxSize + 1));
+        std::vector<std::thread> workers;
+        for (size_t w = 0; w < workerCount; ++w) {
+           workers.emplace_back([&, w] {
+              for (size_t i = w; i <= maxSize; i += workerCount) {
+                 buildChild(i, childThreads);
+              }
+           });
+        }
+        for (auto& w : workers) {
+           w.join();
+        }
+     }
+     node->refresh();
+     return node;
+  }
 
   std::shared_ptr<Node> rootNode;
-    
+  std::unique_ptr<BackgroundCheckpoint> background;
+
+  //The deepest ancestor of node, or node itself, whose subtree spans
+  //elem: a search for elem can start there, as nothing outside it can
+  //match. A subtree is bounded by the elements either side of it in its
+  //parent, or where it is the first or last child, by its parent's own
+  //bound on that side, which is resolved further up
+  const Node* fingerFrom(const Node* node, const T& elem) const {
+     const Node* top = node;
+     bool needLow = true;
+     bool needHigh = true;
+     while ((needLow || needHigh) && node->parent != nullptr && !node->val.empty()) {
+        const Node* up = node->parent;
+        auto slot = up->val.begin() + up->lowerBoundIn(node->val.front());
+        bool outside = false;
+        if (needLow && slot != up->val.begin()) {
+           needLow = false;
+           outside = !(*(slot - 1) < elem);
+        }
+        if (needHigh && slot != up->val.end()) {
+           needHigh = false;
+           outside = outside || !(elem < *slot);
+        }
+        if (outside) {
+           top = up;
+           needLow = needHigh = true;
+        }
+        node = up;
+     }
+     return top;
+  }
+
+  //find and lower_bound from a finger. The tree's nodes are not const
+  //even when it is, so the node found is handed back as mutable
+  Node* fingerFind(const Node* hint, const T& elem, size_t& pos) const {
+     if (filterRejects(elem)) {
+        return nullptr;
+     }
+     //a match below the hint's node is the match, wherever its bounds lie
+     Node* node = const_cast<Node*>(hint)->nodeFind(elem, pos);
+     if (node != nullptr) {
+        return node;
+     }
+     node = const_cast<Node*>(fingerFrom(hint, elem))->nodeFind(elem, pos);
+     if (node == nullptr) {
+        filterMissed();
+     }
+     return node;
+  }
+
+  Node* fingerLowerBound(const Node* hint, const T& elem, size_t& pos) const {
+     //likewise the least element not less than elem below the hint's node,
+     //provided an element there is less than elem: everything outside on
+     //the left is then less too, and everything on the right greater
+     Node* node;
+     if (!hint->val.empty() && hint->val.front() < elem) {
+        node = const_cast<Node*>(hint)->nodeLowerBound(elem, pos);
+        if (node != nullptr) {
+           return node;
+        }
+     }
+     Node* top = const_cast<Node*>(fingerFrom(hint, elem));
+     node = top->nodeLowerBound(elem, pos);
+     if (node != nullptr) {
+        return node;
+     }
+     //everything below top is less than elem: the answer is the bound on
+     //its right, held by the first ancestor that has one
+     for (; top->parent != nullptr && !top->val.empty(); top = top->parent) {
+        Node* up = top->parent;
+        auto slot = up->val.begin() + up->lowerBoundIn(top->val.front());
+        if (slot != up->val.end()) {
+           pos = slot - up->val.begin();
+           return up;
+        }
+     }
+     return nullptr;
+  }
+
+  //A filter of the elements, sized for capacity of them. added counts
+  //those in it, erased ones included
+  struct Filter {
+     explicit Filter(size_t bits): bitsPerKey{bits} {}
+     Filter(const Filter& other): bloom{other.bloom}, bitsPerKey{other.bitsPerKey}, capacity{other.capacity},
+                                  added{other.added}, erased{other.erased} {}
+
+     btree_bloom<T> bloom;
+     size_t bitsPerKey;
+     size_t capacity = 0;
+     size_t added = 0;
+     size_t erased = 0;
+     //bumped by concurrent readers
+     mutable std::atomic<uint64_t> lookups{0};
+     mutable std::atomic<uint64_t> rejected{0};
+     mutable std::atomic<uint64_t> falsePositives{0};
+  };
+  std::unique_ptr<Filter> filter;
+
+  //Whether the filter rules elem out
+  bool filterRejects(const T& elem) const {
+     if constexpr (btree_hashable<T>::value) {
+        if (filter != nullptr) {
+           filter->lookups.fetch_add(1, std::memory_order_relaxed);
+           if (!filter->bloom.may_contain(elem)) {
+              filter->rejected.fetch_add(1, std::memory_order_relaxed);
+              return true;
+           }
+        }
+     }
+     return false;
+  }
+
+  //A lookup the filter let through found nothing
+  void filterMissed() const {
+     if (filter != nullptr) {
+        filter->falsePositives.fetch_add(1, std::memory_order_relaxed);
+     }
+  }
+
+  std::pair<iterator, bool> filterAdded(std::pair<iterator, bool> result) {
+     if constexpr (btree_hashable<T>::value) {
+        if (filter != nullptr && result.second) {
+           if (++filter->added > filter->capacity) {
+              refilter();
+           } else {
+              filter->bloom.add(*result.first);
+           }
+        }
+     }
+     return result;
+  }
+
+  void filterErased() {
+     if (filter != nullptr && ++filter->erased > filter->added / 2) {
+        refilter();
+     }
+  }
+
+  //Rebuilds the filter from the elements, with room to double
+  void refilter() {
+     if constexpr (btree_hashable<T>::value) {
+        if (filter == nullptr) {
+           return;
+        }
+        size_t count = 0;
+        for (auto it = cbegin(); it != cend(); ++it) {
+           ++count;
+        }
+        filter->capacity = std::max<size_t>(2 * count, 1024);
+        filter->bloom = btree_bloom<T>(filter->capacity, filter->bitsPerKey);
+        for (auto it = cbegin(); it != cend(); ++it) {
+           filter->bloom.add(*it);
+        }
+        filter->added = count;
+        filter->erased = 0;
+     }
+  }
+
   // The details of your implementation go here
 };
 
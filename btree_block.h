@@ -0,0 +1,128 @@
+#ifndef BTREE_BLOCK_H
+#define BTREE_BLOCK_H
+
+/*
+ * Single-block btree nodes.  A node is made by std::allocate_shared with
+ * a btree_block_allocator, which asks for room for the shared_ptr control
+ * block (holding the node itself) and a tail of extra bytes after it, in
+ * one cache-line-aligned allocation.  The tail starts at the first cache
+ * line boundary past everything the library asked for, so it never
+ * overlaps the control block however that is laid out; the allocator
+ * reserves a line of slack so that boundary always lies inside the block.
+ * The library constructs the node through the allocator, which hands the
+ * node its tail as the first constructor argument.  The node lays its
+ * first elements (where they can live in place) and its child links out
+ * there.
+ *
+ * btree_links is the fixed array the child links live in.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+constexpr size_t btree_line_bytes = 64;
+
+//The first address at or after p that is a multiple of align
+inline char* btree_align_up(const void* p, size_t align) {
+   uintptr_t at = reinterpret_cast<uintptr_t>(p);
+   return reinterpret_cast<char*>((at + align - 1) / align * align);
+}
+
+template <typename U>
+struct btree_block_allocator {
+   typedef U value_type;
+
+  /**
+    * @param tail bytes the object will lay out past the control block,
+    *        from the next cache line boundary on.
+    * @param at where allocate records the start of those bytes, for
+    *        construct to pass on; it must outlive the allocate_shared call.
+    */
+   btree_block_allocator(size_t tail, char** at): tail{tail}, at{at} {}
+
+   template <typename V>
+   btree_block_allocator(const btree_block_allocator<V>& other): tail{other.tail}, at{other.at} {}
+
+   U* allocate(size_t n) {
+      char* block = static_cast<char*>(::operator new(bytes(n), std::align_val_t{btree_line_bytes}));
+      *at = btree_align_up(block + n * sizeof(U), btree_line_bytes);
+      return reinterpret_cast<U*>(block);
+   }
+
+   void deallocate(U* p, size_t n) {
+      ::operator delete(p, bytes(n), std::align_val_t{btree_line_bytes});
+   }
+
+   //Builds the object with the tail of the block last allocated
+   template <typename V, typename... Args>
+   void construct(V* p, Args&&... args) {
+      ::new (static_cast<void*>(p)) V(*at, std::forward<Args>(args)...);
+   }
+
+   size_t bytes(size_t n) const {
+      return n * sizeof(U) + btree_line_bytes + tail;
+   }
+
+   template <typename V>
+   bool operator==(const btree_block_allocator<V>& other) const {
+      return tail == other.tail && at == other.at;
+   }
+   template <typename V>
+   bool operator!=(const btree_block_allocator<V>& other) const {
+      return !operator==(other);
+   }
+
+   size_t tail;
+   char** at;
+};
+
+// A fixed number of U constructed in storage someone else owns, and
+// destroyed with this
+template <typename U>
+class btree_links {
+ public:
+   btree_links(void* storage, size_t n): items{static_cast<U*>(storage)}, count{n} {
+      for (size_t i = 0; i < count; ++i) {
+         new (items + i) U();
+      }
+   }
+
+   btree_links(const btree_links&) = delete;
+   btree_links& operator=(const btree_links&) = delete;
+
+   ~btree_links() {
+      for (size_t i = count; i-- > 0;) {
+         items[i].~U();
+      }
+   }
+
+   size_t size() const {
+      return count;
+   }
+   U& operator[](size_t i) {
+      return items[i];
+   }
+   const U& operator[](size_t i) const {
+      return items[i];
+   }
+   U* begin() {
+      return items;
+   }
+   U* end() {
+      return items + count;
+   }
+   const U* begin() const {
+      return items;
+   }
+   const U* end() const {
+      return items + count;
+   }
+
+ private:
+   U* items;
+   size_t count;
+};
+
+#endif
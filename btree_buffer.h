@@ -0,0 +1,243 @@
+#ifndef BTREE_BUFFER_H
+#define BTREE_BUFFER_H
+
+/*
+ * A raw sequence for trivially copyable elements: the sorted elements of
+ * a btree node, kept in an aligned buffer that is only ever moved with
+ * memmove and memcpy.
+ *
+ * std::vector comes close for such types, but through insert and copy
+ * paths written for any element type, and it grows from a capacity of
+ * one.  Here inserting is one memmove of the tail and a memcpy of the
+ * element, erasing one memmove, and a copy one memcpy of the whole node;
+ * capacity starts at a cache line.  The interface is the part of
+ * std::vector the btree uses.
+ *
+ * A buffer can also be placed in storage it does not own, such as the
+ * tail of a node's block (see btree_block.h); it moves to the heap only
+ * if it outgrows that.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <typename T>
+class btree_buffer {
+   static_assert(std::is_trivially_copyable<T>::value, "btree_buffer holds trivially copyable types only");
+
+ public:
+   typedef T*       iterator;
+   typedef const T* const_iterator;
+
+   btree_buffer() = default;
+
+   btree_buffer(const btree_buffer& other) {
+      assign(other.begin(), other.end());
+   }
+
+   btree_buffer(btree_buffer&& other) {
+      *this = std::move(other);
+   }
+
+   btree_buffer& operator=(const btree_buffer& other) {
+      if (this != &other) {
+         assign(other.begin(), other.end());
+      }
+      return *this;
+   }
+
+   //Storage the other buffer does not own stays with it; the elements
+   //are copied out instead
+   btree_buffer& operator=(btree_buffer&& other) {
+      if (this != &other && !other.owned) {
+         assign(other.begin(), other.end());
+         other.clear();
+      } else if (this != &other) {
+         release();
+         data = other.data;
+         count = other.count;
+         capacity = other.capacity;
+         owned = true;
+         other.data = nullptr;
+         other.count = 0;
+         other.capacity = 0;
+         other.owned = false;
+      }
+      return *this;
+   }
+
+   ~btree_buffer() {
+      release();
+   }
+
+   size_t size() const {
+      return count;
+   }
+   bool empty() const {
+      return count == 0;
+   }
+   void reserve(size_t n) {
+      if (n > capacity) {
+         grow(n);
+      }
+   }
+   void clear() {
+      count = 0;
+   }
+
+  /**
+    * Keeps the elements in storage, which must outlive the buffer, from
+    * now on. Only while empty.
+    *
+    * @param n how many elements storage has room for.
+    */
+   void place(T* storage, size_t n) {
+      release();
+      data = storage;
+      capacity = n;
+      owned = false;
+   }
+
+   T& operator[](size_t i) {
+      return data[i];
+   }
+   const T& operator[](size_t i) const {
+      return data[i];
+   }
+   T& front() {
+      return data[0];
+   }
+   const T& front() const {
+      return data[0];
+   }
+   T& back() {
+      return data[count - 1];
+   }
+   const T& back() const {
+      return data[count - 1];
+   }
+
+   iterator begin() {
+      return data;
+   }
+   iterator end() {
+      return data + count;
+   }
+   const_iterator begin() const {
+      return data;
+   }
+   const_iterator end() const {
+      return data + count;
+   }
+   const_iterator cbegin() const {
+      return begin();
+   }
+   const_iterator cend() const {
+      return end();
+   }
+
+  /**
+    * Replaces the contents with [first, last), copied in one memcpy when
+    * the range is contiguous elements of T.
+    */
+   template <typename InputIt>
+   void assign(InputIt first, InputIt last) {
+      size_t n = static_cast<size_t>(std::distance(first, last));
+      count = 0;
+      reserve(n);
+      if constexpr (std::is_pointer<InputIt>::value) {
+         if (n != 0) {
+            std::memcpy(static_cast<void*>(data), first, n * sizeof(T));
+         }
+      } else {
+         std::copy(first, last, data);
+      }
+      count = n;
+   }
+
+   void push_back(const T& elem) {
+      if (count == capacity) {
+         //elem may live in this buffer, which grow frees
+         T copy = elem;
+         grow(nextCapacity());
+         std::memcpy(static_cast<void*>(data + count), &copy, sizeof(T));
+      } else {
+         std::memcpy(static_cast<void*>(data + count), &elem, sizeof(T));
+      }
+      ++count;
+   }
+
+  /**
+    * Places elem before pos, moving the tail up with one memmove.
+    *
+    * @return an iterator to elem.
+    */
+   iterator insert(const_iterator pos, const T& elem) {
+      size_t at = static_cast<size_t>(pos - data);
+      T copy = elem;
+      if (count == capacity) {
+         grow(nextCapacity());
+      }
+      std::memmove(static_cast<void*>(data + at + 1), data + at, (count - at) * sizeof(T));
+      std::memcpy(static_cast<void*>(data + at), &copy, sizeof(T));
+      ++count;
+      return data + at;
+   }
+
+   iterator erase(const_iterator pos) {
+      return erase(pos, pos + 1);
+   }
+
+   iterator erase(const_iterator first, const_iterator last) {
+      size_t from = static_cast<size_t>(first - data);
+      size_t to = static_cast<size_t>(last - data);
+      std::memmove(static_cast<void*>(data + from), data + to, (count - to) * sizeof(T));
+      count -= to - from;
+      return data + from;
+   }
+
+   void pop_back() {
+      --count;
+   }
+
+ private:
+   static constexpr size_t alignment = alignof(T) > alignof(std::max_align_t) ? alignof(T) : alignof(std::max_align_t);
+
+   //Doubles, starting from a cache line's worth
+   size_t nextCapacity() const {
+      size_t line = 64 / sizeof(T) != 0 ? 64 / sizeof(T) : 1;
+      return std::max(line, 2 * capacity);
+   }
+
+   void grow(size_t n) {
+      T* bigger = static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{alignment}));
+      if (count != 0) {
+         std::memcpy(static_cast<void*>(bigger), data, count * sizeof(T));
+      }
+      release();
+      data = bigger;
+      capacity = n;
+      owned = true;
+   }
+
+   void release() {
+      if (owned) {
+         ::operator delete(data, std::align_val_t{alignment});
+      }
+      data = nullptr;
+      capacity = 0;
+      owned = false;
+   }
+
+   T* data = nullptr;
+   size_t count = 0;
+   size_t capacity = 0;
+   bool owned = false;
+};
+
+#endif
@@ -0,0 +1,538 @@
+#ifndef BTREE_CHECKPOINT_H
+#define BTREE_CHECKPOINT_H
+
+/*
+ * Incremental checkpoints of a btree.
+ *
+ * Where btree::save rewrites every element, a btree_checkpoint appends
+ * to its file only the nodes that changed since the previous checkpoint.
+ * The btree marks a node dirty whenever its elements or children change,
+ * and flags its ancestors so the checkpoint can find it without walking
+ * clean subtrees.  Each checkpoint (a generation) is a run of node
+ * records, a record listing the nodes destroyed since the last one, and
+ * finally a manifest naming the root.  A generation counts only once its
+ * manifest is on disk, so a crash mid-checkpoint falls back to the one
+ * before.
+ *
+ * Superseded and destroyed node records pile up in the file, so once it
+ * grows past a multiple of the live data a background thread compacts
+ * it: the live records are copied to a fresh file, generations appended
+ * meanwhile are carried over, and the fresh file is renamed into place.
+ *
+ * A checkpoint file follows one btree.  Nodes remember which file they
+ * were written to, so subtrees moved in from another btree (by join,
+ * merge and so on) are written in full the next time.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "btree.h"
+
+template <typename T, typename Augment = void>
+class btree_checkpoint {
+ public:
+  /**
+    * Opens (or creates) the checkpoint file at path and reads its last
+    * complete generation, ready for recover().  Anything after that
+    * generation, such as a checkpoint torn by a crash, is cut off.
+    *
+    * @param path the checkpoint file.
+    * @param compactionRatio compact in the background once the file is
+    *        this many times larger than its live records; 0 never does.
+    * @throws std::system_error on I/O failure, std::runtime_error if the
+    *         file is not a checkpoint file.
+    */
+   explicit btree_checkpoint(const std::string& path, double compactionRatio = 2.0)
+         : path{path}, ratio{compactionRatio}, token{btree_retired_nodes::open()} {
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+      if (fd < 0) {
+         btree_retired_nodes::close(token);
+         throw std::system_error(errno, std::generic_category(), "btree_checkpoint: open " + path);
+      }
+      try {
+         image = readImage(fd, fileSize(fd));
+         if (image.end == 0) {
+            std::string header(fileMagic, 8);
+            btree_bytes::putFixed<uint32_t>(header, fileVersion);
+            if (::ftruncate(fd, 0) != 0) {
+               throw std::system_error(errno, std::generic_category(), "btree_checkpoint: truncate");
+            }
+            append(header);
+            image.end = header.size();
+         } else if (::ftruncate(fd, image.end) != 0) {
+            throw std::system_error(errno, std::generic_category(), "btree_checkpoint: truncate");
+         }
+      } catch (...) {
+         ::close(fd);
+         btree_retired_nodes::close(token);
+         throw;
+      }
+      fileBytes = image.end;
+      generation = image.generation;
+      nextId = image.nextId;
+      for (const auto& record : image.nodes) {
+         liveBytes += record.second.size() + frameBytes;
+      }
+   }
+
+   ~btree_checkpoint() {
+      if (compactor.joinable()) {
+         compactor.join();
+      }
+      ::close(fd);
+      btree_retired_nodes::close(token);
+   }
+
+   btree_checkpoint(const btree_checkpoint&) = delete;
+   btree_checkpoint& operator=(const btree_checkpoint&) = delete;
+
+  /**
+    * Replaces the contents of tree with the last checkpoint.  The nodes
+    * are built straight from their records and start out clean, so the
+    * next checkpoint writes only what changes after this.  Must be
+    * called, if at all, before the first checkpoint.
+    *
+    * @param tree the btree to restore.
+    * @throws std::runtime_error if the file references a missing or
+    *         malformed node, std::logic_error if called too late.
+    */
+   void recover(btree<T, Augment>& tree) {
+      if (!image.pending) {
+         throw std::logic_error("btree_checkpoint::recover: checkpoints already taken");
+      }
+      if (image.root != 0) {
+         std::unordered_map<uint64_t, bool> reached;
+         tree.rootNode = buildNode(image.root, nullptr, reached);
+         for (const auto& record : image.nodes) {
+            if (reached.count(record.first) == 0) {
+               orphans.push_back(record.first);
+            }
+         }
+      } else {
+         tree.rootNode = Node::create(nullptr, image.maxNodeElems != 0 ? image.maxNodeElems : 40);
+      }
+      tree.refilter();
+      releaseImage();
+   }
+
+  /**
+    * Appends a new generation holding the nodes of tree changed since the
+    * last checkpoint, and syncs it.  tree must not change meanwhile.
+    *
+    * @param tree the btree this file follows.
+    * @return the number of node records written.
+    * @throws std::system_error if writing fails.
+    */
+   size_t checkpoint(btree<T, Augment>& tree) {
+      std::vector<uint64_t> retired = btree_retired_nodes::drain(token);
+      if (image.pending) {
+         //checkpointing a tree that was not recovered from this file: every
+         //record already here is dead
+         for (const auto& record : image.nodes) {
+            retired.push_back(record.first);
+         }
+         releaseImage();
+      }
+      retired.insert(retired.end(), orphans.begin(), orphans.end());
+      orphans.clear();
+
+      std::string out;
+      size_t written = 0;
+      Node* root = tree.rootNode.get();
+      collect(root, out, written);
+
+      std::string payload;
+      btree_bytes::putVarint(payload, retired.size());
+      for (uint64_t id : retired) {
+         btree_bytes::putVarint(payload, id);
+         auto found = recordBytes.find(id);
+         if (found != recordBytes.end()) {
+            liveBytes -= found->second;
+            recordBytes.erase(found);
+         }
+      }
+      frame(out, retireRecord, payload);
+
+      payload.clear();
+      btree_bytes::putVarint(payload, generation + 1);
+      btree_bytes::putVarint(payload, root->id);
+      btree_bytes::putVarint(payload, nextId);
+      btree_bytes::putVarint(payload, root->maxSize);
+      frame(out, manifestRecord, payload);
+
+      {
+         std::lock_guard<std::mutex> lock{fileMutex};
+         append(out);
+         sync(fd);
+         fileBytes += out.size();
+      }
+      ++generation;
+
+      if (ratio > 0 && fileBytes > ratio * (liveBytes + 4096) && !compacting) {
+         compact_async();
+      }
+      return written;
+   }
+
+  /**
+    * Rewrites the file with only its live records, merging every
+    * generation so far into one, while checkpoints carry on.
+    */
+   void compact_async() {
+      if (compacting.exchange(true)) {
+         return;
+      }
+      if (compactor.joinable()) {
+         compactor.join();
+      }
+      compactor = std::thread([this] {
+         try {
+            compact();
+         } catch (...) {
+            std::lock_guard<std::mutex> lock{fileMutex};
+            failure = std::current_exception();
+         }
+         compacting = false;
+      });
+   }
+
+  /**
+    * Waits for a background compaction to finish.
+    *
+    * @throws whatever the compaction failed with, if it did.
+    */
+   void wait_compaction() {
+      if (compactor.joinable()) {
+         compactor.join();
+      }
+      std::exception_ptr error;
+      {
+         std::lock_guard<std::mutex> lock{fileMutex};
+         std::swap(error, failure);
+      }
+      if (error) {
+         std::rethrow_exception(error);
+      }
+   }
+
+   //Checkpoints taken over the life of the file
+   uint64_t generations() const {
+      return generation;
+   }
+
+   //Current size of the checkpoint file
+   size_t file_bytes() const {
+      std::lock_guard<std::mutex> lock{fileMutex};
+      return fileBytes;
+   }
+
+ private:
+   typedef typename btree<T, Augment>::Node Node;
+   typedef std::shared_ptr<Node> NodePtr;
+
+   //File layout: magic and version, then records of
+   //[kind][payload length][crc32 of kind and payload][payload]
+   static constexpr const char* fileMagic = "BTRECKPT";
+   static constexpr uint32_t fileVersion = 1;
+   static constexpr size_t frameBytes = 9;
+   static constexpr uint8_t nodeRecord = 1;
+   static constexpr uint8_t retireRecord = 2;
+   static constexpr uint8_t manifestRecord = 3;
+
+   //The last complete generation of a file: the latest record of every
+   //live node, keyed by id
+   struct Image {
+      std::unordered_map<uint64_t, std::string> nodes;
+      uint64_t root = 0;
+      uint64_t generation = 0;
+      uint64_t nextId = 1;
+      size_t maxNodeElems = 0;
+      size_t end = 0;        // offset just past the last manifest
+      bool pending = true;   // not yet handed to recover or checkpoint
+   };
+
+   static size_t fileSize(int fd) {
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+         throw std::system_error(errno, std::generic_category(), "btree_checkpoint: stat");
+      }
+      return static_cast<size_t>(st.st_size);
+   }
+
+   static void sync(int fd) {
+      if (::fdatasync(fd) != 0) {
+         throw std::system_error(errno, std::generic_category(), "btree_checkpoint: fdatasync");
+      }
+   }
+
+   static void writeAll(int fd, const std::string& bytes) {
+      size_t done = 0;
+      while (done < bytes.size()) {
+         ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+         if (n < 0 && errno == EINTR) {
+            continue;
+         } else if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "btree_checkpoint: write");
+         }
+         done += static_cast<size_t>(n);
+      }
+   }
+
+   static std::string readRange(int fd, size_t from, size_t to) {
+      std::string bytes(to - from, '\0');
+      size_t done = 0;
+      while (done < bytes.size()) {
+         ssize_t n = ::pread(fd, &bytes[done], bytes.size() - done, from + done);
+         if (n < 0 && errno == EINTR) {
+            continue;
+         } else if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "btree_checkpoint: read");
+         } else if (n == 0) {
+            bytes.resize(done);
+            break;
+         }
+         done += static_cast<size_t>(n);
+      }
+      return bytes;
+   }
+
+   static void frame(std::string& out, uint8_t kind, const std::string& payload) {
+      std::string head(1, static_cast<char>(kind));
+      btree_bytes::putFixed<uint32_t>(head, static_cast<uint32_t>(payload.size()));
+      uint32_t crc = btree_crc32(head.data(), 1);
+      crc = btree_crc32(payload.data(), payload.size(), crc);
+      btree_bytes::putFixed<uint32_t>(head, crc);
+      out += head;
+      out += payload;
+   }
+
+   //Reads the first limit bytes of a checkpoint file. Generations after
+   //the last complete manifest are ignored
+   static Image readImage(int fd, size_t limit) {
+      Image img;
+      std::string bytes = readRange(fd, 0, limit);
+      if (bytes.empty()) {
+         return img;
+      }
+      if (bytes.size() < 12 || bytes.compare(0, 8, fileMagic, 8) != 0 ||
+          btree_bytes::getFixed<uint32_t>(&bytes[8]) != fileVersion) {
+         throw std::runtime_error("btree_checkpoint: not a checkpoint file");
+      }
+      img.end = 12;
+
+      std::unordered_map<uint64_t, std::string> nodes;
+      std::vector<uint64_t> retired;
+      size_t at = 12;
+      while (bytes.size() - at >= frameBytes) {
+         uint8_t kind = static_cast<uint8_t>(bytes[at]);
+         uint32_t n = btree_bytes::getFixed<uint32_t>(&bytes[at + 1]);
+         uint32_t crc = btree_bytes::getFixed<uint32_t>(&bytes[at + 5]);
+         if (bytes.size() - at - frameBytes < n ||
+             btree_crc32(&bytes[at + frameBytes], n, btree_crc32(&bytes[at], 1)) != crc) {
+            break;
+         }
+         const char* in = &bytes[at + frameBytes];
+         const char* end = in + n;
+         try {
+            if (kind == nodeRecord) {
+               const char* body = in;
+               nodes[btree_bytes::getVarint(body, end)] = std::string(in, n);
+            } else if (kind == retireRecord) {
+               for (uint64_t count = btree_bytes::getVarint(in, end); count > 0; --count) {
+                  retired.push_back(btree_bytes::getVarint(in, end));
+               }
+            } else if (kind == manifestRecord) {
+               img.generation = btree_bytes::getVarint(in, end);
+               img.root = btree_bytes::getVarint(in, end);
+               img.nextId = btree_bytes::getVarint(in, end);
+               img.maxNodeElems = btree_bytes::getVarint(in, end);
+               for (auto& record : nodes) {
+                  img.nodes[record.first] = std::move(record.second);
+               }
+               for (uint64_t id : retired) {
+                  img.nodes.erase(id);
+               }
+               nodes.clear();
+               retired.clear();
+               img.end = at + frameBytes + n;
+            } else {
+               break;
+            }
+         } catch (const std::runtime_error&) {
+            break;
+         }
+         at += frameBytes + n;
+      }
+      return img;
+   }
+
+   void append(const std::string& bytes) {
+      writeAll(fd, bytes);
+   }
+
+   void releaseImage() {
+      for (const auto& record : image.nodes) {
+         recordBytes[record.first] = record.second.size() + frameBytes;
+      }
+      image.nodes.clear();
+      image.pending = false;
+   }
+
+   //Writes the records of node's subtree that this file lacks: children
+   //first, so ids are known when the parent is encoded
+   void collect(Node* node, std::string& out, size_t& written) {
+      bool known = node->writtenBy == token;
+      if (!known || node->dirtyBelow || node->dirty) {
+         for (size_t i = 0; i <= node->val.size(); ++i) {
+            Node* child = node->children[i].get();
+            if (child != nullptr && (child->writtenBy != token || child->dirty || child->dirtyBelow)) {
+               collect(child, out, written);
+            }
+         }
+      }
+      if (!known || node->dirty) {
+         if (!known) {
+            node->id = nextId++;
+            node->writtenBy = token;
+         }
+         std::string payload;
+         btree_bytes::putVarint(payload, node->id);
+         btree_bytes::putVarint(payload, node->val.size());
+         for (size_t i = 0; i < node->val.size(); ++i) {
+            btree_codec<T>::encode(payload, node->val[i], i == 0 ? nullptr : &node->val[i - 1]);
+         }
+         for (size_t i = 0; i <= node->val.size(); ++i) {
+            Node* child = node->children[i].get();
+            btree_bytes::putVarint(payload, child != nullptr ? child->id : 0);
+         }
+         frame(out, nodeRecord, payload);
+
+         size_t& bytes = recordBytes[node->id];
+         liveBytes += payload.size() + frameBytes;
+         liveBytes -= bytes;
+         bytes = payload.size() + frameBytes;
+         ++written;
+      }
+      node->dirty = false;
+      node->dirtyBelow = false;
+   }
+
+   NodePtr buildNode(uint64_t id, Node* parent, std::unordered_map<uint64_t, bool>& reached) {
+      auto found = image.nodes.find(id);
+      if (found == image.nodes.end() || reached.count(id) != 0) {
+         throw std::runtime_error("btree_checkpoint: missing node record");
+      }
+      reached[id] = true;
+      const char* in = found->second.data();
+      const char* end = in + found->second.size();
+      btree_bytes::getVarint(in, end);
+      size_t n = btree_bytes::getVarint(in, end);
+      if (n == 0 && parent != nullptr) {
+         throw std::runtime_error("btree_checkpoint: empty node record");
+      } else if (n > image.maxNodeElems) {
+         throw std::runtime_error("btree_checkpoint: node record too large");
+      }
+
+      auto node = Node::create(parent, image.maxNodeElems);
+      node->val.reserve(n);
+      for (size_t i = 0; i < n; ++i) {
+         node->val.push_back(btree_codec<T>::decode(in, end, i == 0 ? nullptr : &node->val.back()));
+      }
+      for (size_t i = 0; i <= n; ++i) {
+         uint64_t child = btree_bytes::getVarint(in, end);
+         if (child != 0) {
+            node->children[i] = buildNode(child, node.get(), reached);
+         }
+      }
+      node->reindex();
+      node->summarise();
+      node->id = id;
+      node->writtenBy = token;
+      node->dirty = false;
+      return node;
+   }
+
+   //Copies the live records up to the current end of the file into a
+   //fresh file, then, holding the file lock, carries over whatever was
+   //appended in the meantime and swaps the fresh file in
+   void compact() {
+      size_t end;
+      {
+         std::lock_guard<std::mutex> lock{fileMutex};
+         end = fileBytes;
+      }
+      Image img = readImage(fd, end);
+
+      std::string out(fileMagic, 8);
+      btree_bytes::putFixed<uint32_t>(out, fileVersion);
+      for (const auto& record : img.nodes) {
+         frame(out, nodeRecord, record.second);
+      }
+      std::string payload;
+      btree_bytes::putVarint(payload, 0);
+      frame(out, retireRecord, payload);
+      payload.clear();
+      btree_bytes::putVarint(payload, img.generation);
+      btree_bytes::putVarint(payload, img.root);
+      btree_bytes::putVarint(payload, img.nextId);
+      btree_bytes::putVarint(payload, img.maxNodeElems);
+      frame(out, manifestRecord, payload);
+
+      std::string tmp = path + ".compact";
+      int fresh = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+      if (fresh < 0) {
+         throw std::system_error(errno, std::generic_category(), "btree_checkpoint: open " + tmp);
+      }
+      try {
+         writeAll(fresh, out);
+         std::lock_guard<std::mutex> lock{fileMutex};
+         std::string tail = readRange(fd, end, fileBytes);
+         writeAll(fresh, tail);
+         sync(fresh);
+         if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "btree_checkpoint: rename " + tmp);
+         }
+         ::close(fd);
+         fd = fresh;
+         fileBytes = out.size() + tail.size();
+      } catch (...) {
+         ::close(fresh);
+         std::remove(tmp.c_str());
+         throw;
+      }
+   }
+
+   std::string path;
+   double ratio;
+   uint64_t token;
+   int fd;
+   Image image;
+   std::vector<uint64_t> orphans;
+
+   uint64_t generation = 0;
+   uint64_t nextId = 1;
+   std::unordered_map<uint64_t, size_t> recordBytes;
+   size_t liveBytes = 0;
+
+   mutable std::mutex fileMutex;
+   size_t fileBytes = 0;
+   std::thread compactor;
+   std::atomic<bool> compacting{false};
+   std::exception_ptr failure;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef BTREE_CODEC_H
+#define BTREE_CODEC_H
+
+/*
+ * Binary encodings used by btree::save and btree::load.
+ *
+ * Elements are written in ascending order, so each one is encoded
+ * relative to the element before it in the same block (prev is null
+ * for the first).  Integral types store the gap to the previous element
+ * as a varint, strings are length-prefixed, and any other trivially
+ * copyable type is stored as its raw bytes.  To make another type
+ * saveable, specialise btree_codec for it.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+
+// LEB128 varints and little-endian fixed-width integers
+struct btree_bytes {
+   static void putVarint(std::string& out, uint64_t v) {
+      while (v >= 0x80) {
+         out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+         v >>= 7;
+      }
+      out.push_back(static_cast<char>(v));
+   }
+
+   static uint64_t getVarint(const char*& in, const char* end) {
+      uint64_t v = 0;
+      for (unsigned shift = 0; shift < 64; shift += 7) {
+         if (in == end) {
+            throw std::runtime_error("btree_codec: truncated varint");
+         }
+         uint8_t byte = static_cast<uint8_t>(*in++);
+         v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+         if ((byte & 0x80) == 0) {
+            return v;
+         }
+      }
+      throw std::runtime_error("btree_codec: overlong varint");
+   }
+
+   template <typename U>
+   static void putFixed(std::string& out, U v) {
+      for (size_t i = 0; i < sizeof(U); ++i) {
+         out.push_back(static_cast<char>((static_cast<uint64_t>(v) >> (8 * i)) & 0xff));
+      }
+   }
+
+   template <typename U>
+   static U getFixed(const char* in) {
+      uint64_t v = 0;
+      for (size_t i = 0; i < sizeof(U); ++i) {
+         v |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+      }
+      return static_cast<U>(v);
+   }
+
+   static void need(const char* in, const char* end, size_t n) {
+      if (static_cast<size_t>(end - in) < n) {
+         throw std::runtime_error("btree_codec: truncated element");
+      }
+   }
+};
+
+// CRC-32 (IEEE 802.3), used to checksum each block
+inline uint32_t btree_crc32(const char* data, size_t n, uint32_t crc = 0) {
+   static const auto table = [] {
+      struct { uint32_t entry[256]; } t;
+      for (uint32_t i = 0; i < 256; ++i) {
+         uint32_t c = i;
+         for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+         }
+         t.entry[i] = c;
+      }
+      return t;
+   }();
+   crc = ~crc;
+   for (size_t i = 0; i < n; ++i) {
+      crc = table.entry[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+   }
+   return ~crc;
+}
+
+template <typename T, typename Enable = void>
+struct btree_codec {
+   static_assert(std::is_trivially_copyable<T>::value,
+                 "btree_codec has no encoding for this type; specialise it");
+
+   static void encode(std::string& out, const T& elem, const T*) {
+      out.append(reinterpret_cast<const char*>(&elem), sizeof(T));
+   }
+
+   static T decode(const char*& in, const char* end, const T*) {
+      btree_bytes::need(in, end, sizeof(T));
+      T elem;
+      std::memcpy(&elem, in, sizeof(T));
+      in += sizeof(T);
+      return elem;
+   }
+};
+
+// Integral elements: the first of a block is stored zigzagged, the rest
+// as the (always positive) gap to their predecessor
+template <typename T>
+struct btree_codec<T, typename std::enable_if<std::is_integral<T>::value &&
+                                             !std::is_same<T, bool>::value>::type> {
+   typedef typename std::make_unsigned<T>::type U;
+
+   static void encode(std::string& out, const T& elem, const T* prev) {
+      if (prev != nullptr) {
+         btree_bytes::putVarint(out, static_cast<U>(static_cast<U>(elem) - static_cast<U>(*prev)));
+      } else if (std::is_signed<T>::value) {
+         U u = static_cast<U>(elem);
+         btree_bytes::putVarint(out, static_cast<U>(u << 1) ^ (elem < 0 ? static_cast<U>(~U(0)) : U(0)));
+      } else {
+         btree_bytes::putVarint(out, static_cast<U>(elem));
+      }
+   }
+
+   static T decode(const char*& in, const char* end, const T* prev) {
+      U u = static_cast<U>(btree_bytes::getVarint(in, end));
+      if (prev != nullptr) {
+         return static_cast<T>(static_cast<U>(static_cast<U>(*prev) + u));
+      } else if (std::is_signed<T>::value) {
+         return static_cast<T>(static_cast<U>(u >> 1) ^ static_cast<U>(U(0) - (u & 1)));
+      }
+      return static_cast<T>(u);
+   }
+};
+
+template <>
+struct btree_codec<std::string> {
+   static void encode(std::string& out, const std::string& elem, const std::string*) {
+      btree_bytes::putVarint(out, elem.size());
+      out += elem;
+   }
+
+   static std::string decode(const char*& in, const char* end, const std::string*) {
+      uint64_t n = btree_bytes::getVarint(in, end);
+      btree_bytes::need(in, end, n);
+      std::string elem(in, n);
+      in += n;
+      return elem;
+   }
+};
+
+#endif
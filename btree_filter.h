@@ -0,0 +1,99 @@
+#ifndef BTREE_FILTER_H
+#define BTREE_FILTER_H
+
+/*
+ * A Bloom filter: a compact set that may report an element it never
+ * saw, but never misses one it did.  Used to skip structures that
+ * cannot hold a key before searching them.
+ *
+ * The filter is blocked: an element's probes all fall in one 64-byte
+ * block picked by its hash, so a query touches a single cache line, at
+ * the cost of a slightly higher false positive rate than probes spread
+ * over the whole filter.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+template <typename T, typename Hash = std::hash<T>>
+class btree_bloom {
+ public:
+  /**
+    * @param expected how many elements will be added.
+    * @param bitsPerKey filter bits per element; 10 gives about a 1%
+    *        false positive rate.
+    */
+   explicit btree_bloom(size_t expected = 0, size_t bitsPerKey = 10) {
+      size_t bits = std::max<size_t>(blockBits, expected * bitsPerKey);
+      blocks.assign((bits + blockBits - 1) / blockBits, Block{});
+      //k = ln 2 * bits per key minimises the false positive rate
+      probes = std::max<size_t>(1, std::min<size_t>(30, static_cast<size_t>(bitsPerKey * 0.69)));
+   }
+
+   void add(const T& elem) {
+      uint64_t h1, h2;
+      hashes(elem, h1, h2);
+      Block& block = blocks[h1 % blocks.size()];
+      uint64_t stride = (h2 >> 32) | 1;
+      for (size_t i = 0; i < probes; ++i) {
+         uint64_t bit = (h2 + i * stride) % blockBits;
+         block.words[bit / 64] |= uint64_t(1) << (bit % 64);
+      }
+   }
+
+   //false means elem was certainly never added
+   bool may_contain(const T& elem) const {
+      uint64_t h1, h2;
+      hashes(elem, h1, h2);
+      const Block& block = blocks[h1 % blocks.size()];
+      uint64_t stride = (h2 >> 32) | 1;
+      for (size_t i = 0; i < probes; ++i) {
+         uint64_t bit = (h2 + i * stride) % blockBits;
+         if ((block.words[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   void clear() {
+      std::fill(blocks.begin(), blocks.end(), Block{});
+   }
+
+   size_t size_bytes() const {
+      return blocks.size() * sizeof(Block);
+   }
+
+ private:
+   static constexpr size_t blockBits = 512;
+
+   struct alignas(64) Block {
+      uint64_t words[blockBits / 64] = {};
+   };
+
+   //Two independent hashes from one: the first picks the block, and the
+   //low and high halves of the second the start and (odd) stride of
+   //Kirsch-Mitzenmacher double hashing within it. std::hash is often the
+   //identity, so it is mixed first
+   static void hashes(const T& elem, uint64_t& h1, uint64_t& h2) {
+      uint64_t h = static_cast<uint64_t>(Hash()(elem));
+      h1 = mix(h);
+      h2 = mix(h ^ 0x9e3779b97f4a7c15ull);
+   }
+
+   static uint64_t mix(uint64_t x) {
+      x += 0x9e3779b97f4a7c15ull;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+      return x ^ (x >> 31);
+   }
+
+   std::vector<Block> blocks;
+   size_t probes;
+};
+
+#endif
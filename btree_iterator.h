@@ -2,15 +2,20 @@
 #define BTREE_ITERATOR_H
 
 #include <iterator>
+#include <vector>
 
-template <typename T> class btree;
-template <typename T>class const_btree_iterator; 
+#include "btree_slots.h"
 
-template <typename T>
+template <typename T, typename Augment = void> class btree;
+template <typename T, typename Augment = void> class btree_iterator;
+template <typename T, typename Augment = void> class const_btree_iterator;
+
+template <typename T, typename Augment>
 class btree_iterator {
 public:
-	friend class const_btree_iterator<T>;
-	using valIterator = typename std::vector<T>::iterator;
+	friend class const_btree_iterator<T, Augment>;
+	friend class btree<T, Augment>;
+	using valIterator = typename btree_elements<T>::iterator;
 	typedef std::ptrdiff_t  						difference_type;
 	typedef std::bidirectional_iterator_tag 		iterator_category;
 	typedef T 										value_type;
@@ -21,25 +26,26 @@ public:
     btree_iterator operator++(int);
     btree_iterator& operator--();
     btree_iterator operator--(int);
-    bool operator==(const btree_iterator<T>&) const;
-    bool operator!=(const btree_iterator<T>&) const;
-    bool operator==(const const_btree_iterator<T>&) const;
-    bool operator!=(const const_btree_iterator<T>&) const;
+    bool operator==(const btree_iterator<T, Augment>&) const;
+    bool operator!=(const btree_iterator<T, Augment>&) const;
+    bool operator==(const const_btree_iterator<T, Augment>&) const;
+    bool operator!=(const const_btree_iterator<T, Augment>&) const;
     reference operator*() const; 
     pointer operator->() const; 
 
-    btree_iterator(typename btree<T>::Node *pointee, valIterator v): ptr{pointee}, pos{v} {}
+    btree_iterator(typename btree<T, Augment>::Node *pointee, valIterator v): ptr{pointee}, pos{v} {}
 
 private:
-	typename btree<T>::Node *ptr;
+	typename btree<T, Augment>::Node *ptr;
 	valIterator pos;
 };
 
-template <typename T>
+template <typename T, typename Augment>
 class const_btree_iterator {
 public:
-	friend class btree_iterator<T>;
-	using valIterator = typename std::vector<T>::const_iterator;
+	friend class btree_iterator<T, Augment>;
+	friend class btree<T, Augment>;
+	using valIterator = typename btree_elements<T>::const_iterator;
 	typedef std::ptrdiff_t  						difference_type;
 	typedef std::bidirectional_iterator_tag 		iterator_category;
 	typedef const T 								value_type;
@@ -50,17 +56,20 @@ public:
     const_btree_iterator operator++(int);
     const_btree_iterator& operator--();
     const_btree_iterator operator--(int);
-    bool operator==(const const_btree_iterator<T>&) const;
-    bool operator!=(const const_btree_iterator<T>&) const;
-    bool operator==(const btree_iterator<T>&) const;
-    bool operator!=(const btree_iterator<T>&) const;
+    bool operator==(const const_btree_iterator<T, Augment>&) const;
+    bool operator!=(const const_btree_iterator<T, Augment>&) const;
+    bool operator==(const btree_iterator<T, Augment>&) const;
+    bool operator!=(const btree_iterator<T, Augment>&) const;
     reference operator*() const { return (*pos); }
     pointer operator->() const {return &(operator*()); }
 
-    const_btree_iterator(const typename btree<T>::Node *pointee, valIterator v): ptr{pointee}, pos{v} {}
+    const_btree_iterator(const typename btree<T, Augment>::Node *pointee, valIterator v): ptr{pointee}, pos{v} {}
+    // a mutable iterator converts, as with the standard containers, so it
+    // can be passed where a const_iterator (such as a lookup hint) is taken
+    const_btree_iterator(const btree_iterator<T, Augment>& other): ptr{other.ptr}, pos{other.pos} {}
 
 private:
-	const typename btree<T>::Node *ptr;
+	const typename btree<T, Augment>::Node *ptr;
 	valIterator pos;
 };
 /**
@@ -72,9 +81,9 @@ private:
 // iterator class btree_iterator (and possibly const_btree_iterator)
 
 
-template <typename T>
-const_btree_iterator<T>& const_btree_iterator<T>::operator++() {
-	T temp = (*pos);
+template <typename T, typename Augment>
+const_btree_iterator<T, Augment>& const_btree_iterator<T, Augment>::operator++() {
+	const T& temp = (*pos);
 	int offset = (pos - ptr->val.begin()) + 1;
 	if (ptr->children[offset] != nullptr) {
 		ptr = ptr->children[offset].get();
@@ -82,28 +91,35 @@ const_btree_iterator<T>& const_btree_iterator<T>::operator++() {
            ptr = ptr->children[0].get();
         } 
         pos = ptr->val.begin();
-	} else if (++pos == ptr->val.end()) {
-		while ((*this) != ptr->root->cend()) {
-			ptr = ptr->parent;
-			pos = std::lower_bound(ptr->val.begin(), ptr->val.end(), temp);
-			if (pos != ptr->val.end()) {
-				break;
+	} else if (pos + 1 == ptr->val.end()) {
+		// climb to the first ancestor holding something bigger; if there
+		// is none we were on the last element and stay at end()
+		auto node = ptr;
+		while (node->parent != nullptr) {
+			node = node->parent;
+			auto next = std::lower_bound(node->val.begin(), node->val.end(), temp);
+			if (next != node->val.end()) {
+				ptr = node;
+				pos = next;
+				return *this;
 			}
 		}
+		++pos;
+	} else {
+		++pos;
 	}
 	return *this;
 }
 
-template <typename T>
-const_btree_iterator<T> const_btree_iterator<T>::operator++(int) {
-	const_btree_iterator<T> tmp {*this};
+template <typename T, typename Augment>
+const_btree_iterator<T, Augment> const_btree_iterator<T, Augment>::operator++(int) {
+	const_btree_iterator<T, Augment> tmp {*this};
 	operator++();
 	return tmp;
 }
 
-template<typename T>
-const_btree_iterator<T>& const_btree_iterator<T>::operator--() {
-	T temp = (*pos);
+template <typename T, typename Augment>
+const_btree_iterator<T, Augment>& const_btree_iterator<T, Augment>::operator--() {
 	int offset = (pos - ptr->val.begin());
 	if (ptr->children[offset] != nullptr) {
 		ptr = ptr->children[offset].get();
@@ -113,11 +129,16 @@ const_btree_iterator<T>& const_btree_iterator<T>::operator--() {
         pos = ptr->val.end();
         --pos;
 	} else if (pos == ptr->val.begin()) {
-		while ((*this) != ptr->root->cbegin()) {
-			ptr = ptr->parent;
-			pos = std::lower_bound(ptr->val.begin(), ptr->val.end(), temp);
-			if (pos != ptr->val.begin()) {
-				--pos;
+		// climb to the first ancestor holding something smaller; if there
+		// is none we were already at begin()
+		const T& temp = (*pos);
+		auto node = ptr;
+		while (node->parent != nullptr) {
+			node = node->parent;
+			auto prev = std::lower_bound(node->val.begin(), node->val.end(), temp);
+			if (prev != node->val.begin()) {
+				ptr = node;
+				pos = --prev;
 				break;
 			}
 		}
@@ -127,42 +148,42 @@ const_btree_iterator<T>& const_btree_iterator<T>::operator--() {
 	return *this;
 }
 
-template <typename T>
-const_btree_iterator<T> const_btree_iterator<T>::operator--(int) {
-	const_btree_iterator<T> tmp {*this};
+template <typename T, typename Augment>
+const_btree_iterator<T, Augment> const_btree_iterator<T, Augment>::operator--(int) {
+	const_btree_iterator<T, Augment> tmp {*this};
 	operator--();
 	return tmp;
 }
 
-template <typename T>
-bool const_btree_iterator<T>::operator==(const btree_iterator<T>& other) const {
-	return this->pos == other.pos;
+template <typename T, typename Augment>
+bool const_btree_iterator<T, Augment>::operator==(const btree_iterator<T, Augment>& other) const {
+	return this->ptr == other.ptr && this->pos == other.pos;
 }
 
-template <typename T>
-bool const_btree_iterator<T>::operator!=(const btree_iterator<T>& other) const {
+template <typename T, typename Augment>
+bool const_btree_iterator<T, Augment>::operator!=(const btree_iterator<T, Augment>& other) const {
 	return (!operator==(other));
 }
 
-template <typename T>
-bool const_btree_iterator<T>::operator==(const const_btree_iterator<T>& other) const {
-	return this->pos == other.pos;
+template <typename T, typename Augment>
+bool const_btree_iterator<T, Augment>::operator==(const const_btree_iterator<T, Augment>& other) const {
+	return this->ptr == other.ptr && this->pos == other.pos;
 }
 
-template <typename T>
-bool const_btree_iterator<T>::operator!=(const const_btree_iterator<T>& other) const {
+template <typename T, typename Augment>
+bool const_btree_iterator<T, Augment>::operator!=(const const_btree_iterator<T, Augment>& other) const {
 	return (!operator==(other));
 }
 
-template <typename T>
-T& btree_iterator<T>::operator*() const { return (*pos); }
+template <typename T, typename Augment>
+T& btree_iterator<T, Augment>::operator*() const { return (*pos); }
 
-template <typename T>
-T* btree_iterator<T>::operator->() const { return &(operator*()); }
+template <typename T, typename Augment>
+T* btree_iterator<T, Augment>::operator->() const { return &(operator*()); }
 
-template <typename T>
-btree_iterator<T>& btree_iterator<T>::operator++() {
-	T temp = (*pos);
+template <typename T, typename Augment>
+btree_iterator<T, Augment>& btree_iterator<T, Augment>::operator++() {
+	const T& temp = (*pos);
 	int offset = (pos - ptr->val.begin()) + 1;
 	if (ptr->children[offset] != nullptr) {
 		ptr = ptr->children[offset].get();
@@ -170,28 +191,35 @@ btree_iterator<T>& btree_iterator<T>::operator++() {
            ptr = ptr->children[0].get();
         } 
         pos = ptr->val.begin();
-	} else if (++pos == ptr->val.end()) {
-		while ((*this) != ptr->root->end()) {
-			ptr = ptr->parent;
-			pos = std::lower_bound(ptr->val.begin(), ptr->val.end(), temp);
-			if (pos != ptr->val.end()) {
-				break;
+	} else if (pos + 1 == ptr->val.end()) {
+		// climb to the first ancestor holding something bigger; if there
+		// is none we were on the last element and stay at end()
+		auto node = ptr;
+		while (node->parent != nullptr) {
+			node = node->parent;
+			auto next = std::lower_bound(node->val.begin(), node->val.end(), temp);
+			if (next != node->val.end()) {
+				ptr = node;
+				pos = next;
+				return *this;
 			}
 		}
+		++pos;
+	} else {
+		++pos;
 	}
 	return *this;
 }
 
-template <typename T>
-btree_iterator<T> btree_iterator<T>::operator++(int) {
-	btree_iterator<T> tmp {*this};
+template <typename T, typename Augment>
+btree_iterator<T, Augment> btree_iterator<T, Augment>::operator++(int) {
+	btree_iterator<T, Augment> tmp {*this};
 	operator++();
 	return tmp;
 }
 
-template<typename T>
-btree_iterator<T>& btree_iterator<T>::operator--() {
-	T temp = (*pos);
+template <typename T, typename Augment>
+btree_iterator<T, Augment>& btree_iterator<T, Augment>::operator--() {
 	int offset = (pos - ptr->val.begin());
 	if (ptr->children[offset] != nullptr) {
 		ptr = ptr->children[offset].get();
@@ -201,11 +229,16 @@ btree_iterator<T>& btree_iterator<T>::operator--() {
         pos = ptr->val.end();
         --pos;
 	} else if (pos == ptr->val.begin()) {
-		while ((*this) != ptr->root->begin()) {
-			ptr = ptr->parent;
-			pos = std::lower_bound(ptr->val.begin(), ptr->val.end(), temp);
-			if (pos != ptr->val.begin()) {
-				--pos;
+		// climb to the first ancestor holding something smaller; if there
+		// is none we were already at begin()
+		const T& temp = (*pos);
+		auto node = ptr;
+		while (node->parent != nullptr) {
+			node = node->parent;
+			auto prev = std::lower_bound(node->val.begin(), node->val.end(), temp);
+			if (prev != node->val.begin()) {
+				ptr = node;
+				pos = --prev;
 				break;
 			}
 		}
@@ -215,30 +248,31 @@ btree_iterator<T>& btree_iterator<T>::operator--() {
 	return *this;
 }
 
-template <typename T>
-btree_iterator<T> btree_iterator<T>::operator--(int) {
-	btree_iterator<T> tmp {*this};
+template <typename T, typename Augment>
+btree_iterator<T, Augment> btree_iterator<T, Augment>::operator--(int) {
+	btree_iterator<T, Augment> tmp {*this};
 	operator--();
 	return tmp;
 }
 
-template <typename T>
-bool btree_iterator<T>::operator==(const btree_iterator<T>& other) const {
-	return this->pos == other.pos;
+template <typename T, typename Augment>
+bool btree_iterator<T, Augment>::operator==(const btree_iterator<T, Augment>& other) const {
+	return this->ptr == other.ptr && this->pos == other.pos;
 }
 
-template <typename T>
-bool btree_iterator<T>::operator!=(const btree_iterator<T>& other) const {
+template <typename T, typename Augment>
+bool btree_iterator<T, Augment>::operator!=(const btree_iterator<T, Augment>& other) const {
 	return (!operator==(other));
 }
 
-template <typename T>
-bool btree_iterator<T>::operator==(const const_btree_iterator<T>& other) const {
-	return this->pos == other.pos;
+template <typename T, typename Augment>
+bool btree_iterator<T, Augment>::operator==(const const_btree_iterator<T, Augment>& other) const {
+	// compared from the const side, whose element iterator takes ours
+	return other == *this;
 }
 
-template <typename T>
-bool btree_iterator<T>::operator!=(const const_btree_iterator<T>& other) const {
+template <typename T, typename Augment>
+bool btree_iterator<T, Augment>::operator!=(const const_btree_iterator<T, Augment>& other) const {
 	return (!operator==(other));
 }
 
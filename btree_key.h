@@ -0,0 +1,166 @@
+#ifndef BTREE_KEY_H
+#define BTREE_KEY_H
+
+/*
+ * Order-preserving byte encodings of elements, used by btree to search
+ * a node by comparing integers instead of elements.
+ *
+ * btree_key_encoder<T>::encode appends bytes to a string (or anything
+ * else with push_back(char)) such that comparing two encodings bytewise,
+ * as memcmp would, with a shorter string that is a prefix of a longer
+ * one coming first, orders them exactly as operator< orders the
+ * elements.  Every encoding here is self-delimiting, so those of a
+ * tuple's members can simply be concatenated:
+ *
+ *   - unsigned integers are written big-endian;
+ *   - signed integers have their sign bit flipped, then as unsigned;
+ *   - floating point has the sign bit flipped for positive numbers and
+ *     every bit flipped for negative ones (-0.0 is written as 0.0, and
+ *     NaNs, being unordered, must not be stored);
+ *   - strings escape each 0x00 as 0x00 0xff and end with 0x00 0x00;
+ *   - pairs and tuples concatenate their members.
+ *
+ * btree_key_prefix packs the first eight bytes of an encoding into a
+ * uint64_t, zero padded, so prefixes compare as the encodings do up to
+ * their eighth byte: a smaller prefix means a smaller element, and only
+ * equal prefixes need the elements themselves compared.  Given a number
+ * of bytes to skip, it packs the eight after them instead, which orders
+ * encodings that agree on the skipped bytes.  To give another
+ * type an encoding, specialise btree_key_encoder for it (and btree_prefixed,
+ * in btree.h, for nodes to search by it).
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+template <typename T, typename = void>
+struct btree_key_encoder {
+   static constexpr bool enabled = false;
+};
+
+template <typename T>
+struct btree_key_encoder<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+   static constexpr bool enabled = true;
+
+   template <typename Out>
+   static void encode(const T& value, Out& out) {
+      typedef typename std::make_unsigned<T>::type Unsigned;
+      Unsigned bits = static_cast<Unsigned>(value);
+      if (std::is_signed<T>::value) {
+         bits ^= static_cast<Unsigned>(Unsigned{1} << (8 * sizeof(T) - 1));
+      }
+      putBigEndian(out, static_cast<uint64_t>(bits), sizeof(T));
+   }
+
+   template <typename Out>
+   static void putBigEndian(Out& out, uint64_t bits, size_t bytes) {
+      for (size_t i = bytes; i-- > 0;) {
+         out.push_back(static_cast<char>((bits >> (8 * i)) & 0xff));
+      }
+   }
+};
+
+template <typename T>
+struct btree_key_encoder<T, typename std::enable_if<std::is_floating_point<T>::value &&
+                                                    (sizeof(T) == 4 || sizeof(T) == 8)>::type> {
+   static constexpr bool enabled = true;
+
+   template <typename Out>
+   static void encode(const T& value, Out& out) {
+      typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type Bits;
+      //-0.0 == 0.0, so both must encode alike
+      T normal = value == 0 ? T(0) : value;
+      Bits bits;
+      std::memcpy(&bits, &normal, sizeof(T));
+      const Bits sign = Bits{1} << (8 * sizeof(T) - 1);
+      bits = (bits & sign) ? ~bits : bits ^ sign;
+      btree_key_encoder<uint64_t>::putBigEndian(out, bits, sizeof(T));
+   }
+};
+
+template <>
+struct btree_key_encoder<std::string> {
+   static constexpr bool enabled = true;
+
+   template <typename Out>
+   static void encode(const std::string& value, Out& out) {
+      for (char c : value) {
+         out.push_back(c);
+         if (c == '\0') {
+            out.push_back('\xff');
+         }
+      }
+      out.push_back('\0');
+      out.push_back('\0');
+   }
+};
+
+template <typename A, typename B>
+struct btree_key_encoder<std::pair<A, B>> {
+   static constexpr bool enabled = btree_key_encoder<A>::enabled && btree_key_encoder<B>::enabled;
+
+   template <typename Out>
+   static void encode(const std::pair<A, B>& value, Out& out) {
+      btree_key_encoder<A>::encode(value.first, out);
+      btree_key_encoder<B>::encode(value.second, out);
+   }
+};
+
+template <typename... Ts>
+struct btree_key_encoder<std::tuple<Ts...>> {
+   static constexpr bool enabled = (btree_key_encoder<Ts>::enabled && ...);
+
+   template <typename Out>
+   static void encode(const std::tuple<Ts...>& value, Out& out) {
+      std::apply([&out](const Ts&... member) { (btree_key_encoder<Ts>::encode(member, out), ...); }, value);
+   }
+};
+
+// Collects the eight bytes written to it after the first skip, ignoring
+// the rest
+struct btree_key_prefix_sink {
+   uint64_t prefix = 0;
+   size_t skip = 0;
+   size_t bytes = 0;
+
+   void push_back(char c) {
+      if (skip != 0) {
+         --skip;
+      } else if (bytes < 8) {
+         prefix |= static_cast<uint64_t>(static_cast<uint8_t>(c)) << (56 - 8 * bytes++);
+      }
+   }
+};
+
+//The eight bytes of value's encoding from byte skip on, big-endian and
+//zero padded
+template <typename T>
+uint64_t btree_key_prefix(const T& value, size_t skip = 0) {
+   btree_key_prefix_sink sink;
+   sink.skip = skip;
+   btree_key_encoder<T>::encode(value, sink);
+   return sink.prefix;
+}
+
+//The same, from an encoding already at hand
+inline uint64_t btree_key_prefix(const char* bytes, size_t size, size_t skip = 0) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   if (skip + 8 <= size) {
+      uint64_t word;
+      std::memcpy(&word, bytes + skip, 8);
+      return __builtin_bswap64(word);
+   }
+#endif
+   uint64_t prefix = 0;
+   for (size_t i = 0; i < 8 && skip + i < size; ++i) {
+      prefix |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[skip + i])) << (56 - 8 * i);
+   }
+   return prefix;
+}
+
+#endif
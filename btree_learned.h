@@ -0,0 +1,215 @@
+#ifndef BTREE_LEARNED_H
+#define BTREE_LEARNED_H
+
+/*
+ * A piecewise-linear learned index (after the PGM-index) over n sorted
+ * distinct integer keys.
+ *
+ * The keys are cut into segments, each a line predicting a key's rank
+ * from the key.  Segments are fitted greedily with a shrinking cone, so
+ * every key's prediction is within the requested error, and the actual
+ * worst error is then measured with the same arithmetic lookups use, so
+ * the window a lookup searches is guaranteed to hold the answer.  The
+ * first keys of the segments are indexed the same way, level upon
+ * level, until a single segment remains.  A lookup walks down the
+ * levels, each narrowing the search to a window of a few slots, and
+ * ends with a window of ranks holding the answer.
+ *
+ * The keys themselves are not stored; both building and lookups read
+ * them through a function from rank to key.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename K>
+class btree_pgm {
+   static_assert(std::is_integral<K>::value, "btree_pgm models integer keys");
+
+ public:
+   btree_pgm() = default;
+
+  /**
+    * @param n the number of keys.
+    * @param keyAt returns the key of rank i, for i < n, in ascending order.
+    * @param maxError how far from its rank a key's prediction may be.
+    */
+   template <typename KeyAt>
+   btree_pgm(size_t n, KeyAt keyAt, size_t maxError = 32): keys{n} {
+      if (n == 0) {
+         return;
+      }
+      size_t eps = std::max<size_t>(maxError, 1);
+      levels.push_back(fit(n, keyAt, eps));
+      errors.push_back(measure(levels.back(), n, keyAt));
+      while (levels.back().size() > 1) {
+         const std::vector<Segment>& below = levels.back();
+         auto firstKey = [&below](size_t i) { return below[i].key; };
+         std::vector<Segment> above = fit(below.size(), firstKey, eps);
+         size_t error = measure(above, below.size(), firstKey);
+         levels.push_back(std::move(above));
+         errors.push_back(error);
+      }
+   }
+
+  /**
+    * Predicts where key would go without reading any keys.
+    *
+    * @param key the key to search for.
+    * @return ranks lo <= hi such that the first key not less than key
+    *         has a rank in [lo, hi] (n standing for none).
+    */
+   std::pair<size_t, size_t> window(const K& key) const {
+      if (keys == 0) {
+         return {0, 0};
+      }
+      //the last segment whose first key is not above key, level by level
+      size_t seg = 0;
+      for (size_t l = levels.size() - 1; l > 0; --l) {
+         const std::vector<Segment>& below = levels[l - 1];
+         auto [lo, hi] = predictWindow(levels[l], seg, below.size(), errors[l], key);
+         size_t past = search(lo, hi, key, [&below](size_t i) { return below[i].key; }, true);
+         seg = past != 0 ? past - 1 : 0;
+      }
+      return predictWindow(levels[0], seg, keys, errors[0], key);
+   }
+
+  /**
+    * @param key the key to search for.
+    * @param keyAt the function the index was built with.
+    * @return the rank of the first key not less than key, or n if none.
+    */
+   template <typename KeyAt>
+   size_t lower_bound(const K& key, KeyAt keyAt) const {
+      auto [lo, hi] = window(key);
+      return search(lo, hi, key, keyAt, false);
+   }
+
+   size_t segment_count() const {
+      return levels.empty() ? 0 : levels[0].size();
+   }
+
+   size_t level_count() const {
+      return levels.size();
+   }
+
+   size_t size_bytes() const {
+      size_t bytes = 0;
+      for (const auto& level : levels) {
+         bytes += level.size() * sizeof(Segment);
+      }
+      return bytes;
+   }
+
+ private:
+   typedef typename std::make_unsigned<K>::type Unsigned;
+
+   //Predicts rank start + slope * (key - first key) for the keys from
+   //start up to the next segment's start
+   struct Segment {
+      K key;
+      double slope;
+      size_t start;
+   };
+
+   static double predict(const Segment& seg, const K& key) {
+      if (key < seg.key) {
+         return static_cast<double>(seg.start);
+      }
+      double dx = static_cast<double>(static_cast<Unsigned>(key) - static_cast<Unsigned>(seg.key));
+      return static_cast<double>(seg.start) + seg.slope * dx;
+   }
+
+   //Greedy shrinking cone: a segment grows while some slope through its
+   //first point keeps every point within eps of its rank
+   template <typename KeyAt>
+   static std::vector<Segment> fit(size_t n, KeyAt keyAt, size_t eps) {
+      std::vector<Segment> segments;
+      size_t start = 0;
+      K first = keyAt(0);
+      double lo = 0;
+      double hi = std::numeric_limits<double>::infinity();
+      for (size_t i = 1; i < n; ++i) {
+         K key = keyAt(i);
+         double dx = static_cast<double>(static_cast<Unsigned>(key) - static_cast<Unsigned>(first));
+         double dy = static_cast<double>(i - start);
+         double low = (dy - eps) / dx;
+         double high = (dy + eps) / dx;
+         if (dx == 0 || low > hi || high < lo) {
+            segments.push_back(Segment{first, slopeWithin(lo, hi), start});
+            start = i;
+            first = key;
+            lo = 0;
+            hi = std::numeric_limits<double>::infinity();
+         } else {
+            lo = std::max(lo, low);
+            hi = std::min(hi, high);
+         }
+      }
+      segments.push_back(Segment{first, slopeWithin(lo, hi), start});
+      return segments;
+   }
+
+   static double slopeWithin(double lo, double hi) {
+      return hi == std::numeric_limits<double>::infinity() ? lo : (lo + hi) / 2;
+   }
+
+   //Worst distance between a key's prediction and its rank, rounded up
+   template <typename KeyAt>
+   static size_t measure(const std::vector<Segment>& segments, size_t n, KeyAt keyAt) {
+      double worst = 0;
+      for (size_t s = 0; s < segments.size(); ++s) {
+         size_t end = s + 1 < segments.size() ? segments[s + 1].start : n;
+         for (size_t i = segments[s].start; i < end; ++i) {
+            worst = std::max(worst, std::fabs(predict(segments[s], keyAt(i)) - static_cast<double>(i)));
+         }
+      }
+      return static_cast<size_t>(std::ceil(worst));
+   }
+
+   //The ranks, among the n a level models, where segment seg predicts
+   //the first key not less (or greater) than key. Clamped to the ranks
+   //the segment covers, plus the next segment's first rank, as the answer
+   //can be that
+   static std::pair<size_t, size_t> predictWindow(const std::vector<Segment>& level, size_t seg, size_t n,
+                                                  size_t error, const K& key) {
+      double from = static_cast<double>(level[seg].start);
+      double to = static_cast<double>(seg + 1 < level.size() ? level[seg + 1].start : n);
+      double p = predict(level[seg], key);
+      //a slot of slack either side absorbs rounding, so truncating (to a
+      //non-negative value) may stand in for floor
+      size_t lo = static_cast<size_t>(std::min(to, std::max(from, p - error - 2)));
+      size_t hi = static_cast<size_t>(std::min(to, std::max(from, p + error + 2)));
+      return {lo, hi};
+   }
+
+   //Binary search of ranks [lo, hi] for the first key not less than key,
+   //or with upper set, greater than key. hi is the answer when the rest
+   //fall short, so it is never read
+   template <typename KeyAt>
+   static size_t search(size_t lo, size_t hi, const K& key, KeyAt keyAt, bool upper) {
+      while (lo < hi) {
+         size_t mid = lo + (hi - lo) / 2;
+         K probe = keyAt(mid);
+         if (upper ? !(key < probe) : probe < key) {
+            lo = mid + 1;
+         } else {
+            hi = mid;
+         }
+      }
+      return lo;
+   }
+
+   size_t keys = 0;
+   //levels[0] models the keys; each level above models the first keys
+   //of the one below, up to a single segment
+   std::vector<std::vector<Segment>> levels;
+   std::vector<size_t> errors;
+};
+
+#endif
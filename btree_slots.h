@@ -0,0 +1,312 @@
+#ifndef BTREE_SLOTS_H
+#define BTREE_SLOTS_H
+
+/*
+ * A slotted sequence: the sorted elements of a btree node, stored so
+ * that keeping them sorted never moves one.
+ *
+ * Elements live in unordered slots, and a small array of slot numbers
+ * lists them in order.  Inserting appends the element to a free slot
+ * and shifts a few bytes of that array; erasing moves the last slot's
+ * element into the freed one.  Nodes of large elements use this in
+ * place of a std::vector, whose insert and erase shift half the node's
+ * elements on average.  The interface is the part of std::vector the
+ * btree uses, with iterators walking the elements in order.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <numeric>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree_buffer.h"
+
+template <typename T>
+class btree_slots {
+ public:
+   template <bool Const>
+   class basic_iterator {
+    public:
+      typedef std::ptrdiff_t                                         difference_type;
+      typedef std::random_access_iterator_tag                        iterator_category;
+      typedef T                                                      value_type;
+      typedef typename std::conditional<Const, const T*, T*>::type   pointer;
+      typedef typename std::conditional<Const, const T&, T&>::type   reference;
+      typedef typename std::conditional<Const, const btree_slots*, btree_slots*>::type Owner;
+
+      basic_iterator(): owner{nullptr}, at{0} {}
+      basic_iterator(Owner o, size_t i): owner{o}, at{i} {}
+
+      //an iterator converts to a const_iterator
+      template <bool C = Const, typename = typename std::enable_if<C>::type>
+      basic_iterator(const basic_iterator<false>& other): owner{other.owner}, at{other.at} {}
+
+      reference operator*() const {
+         return owner->slots[owner->order[at]];
+      }
+      pointer operator->() const {
+         return &(operator*());
+      }
+      reference operator[](difference_type n) const {
+         return *(*this + n);
+      }
+
+      basic_iterator& operator++() {
+         ++at;
+         return *this;
+      }
+      basic_iterator operator++(int) {
+         basic_iterator tmp{*this};
+         ++at;
+         return tmp;
+      }
+      basic_iterator& operator--() {
+         --at;
+         return *this;
+      }
+      basic_iterator operator--(int) {
+         basic_iterator tmp{*this};
+         --at;
+         return tmp;
+      }
+      basic_iterator& operator+=(difference_type n) {
+         at += n;
+         return *this;
+      }
+      basic_iterator& operator-=(difference_type n) {
+         at -= n;
+         return *this;
+      }
+      basic_iterator operator+(difference_type n) const {
+         return basic_iterator(owner, at + n);
+      }
+      friend basic_iterator operator+(difference_type n, const basic_iterator& it) {
+         return it + n;
+      }
+      basic_iterator operator-(difference_type n) const {
+         return basic_iterator(owner, at - n);
+      }
+      difference_type operator-(const basic_iterator& other) const {
+         return static_cast<difference_type>(at) - static_cast<difference_type>(other.at);
+      }
+
+      bool operator==(const basic_iterator& other) const {
+         return owner == other.owner && at == other.at;
+      }
+      bool operator!=(const basic_iterator& other) const {
+         return !operator==(other);
+      }
+      bool operator<(const basic_iterator& other) const {
+         return at < other.at;
+      }
+      bool operator>(const basic_iterator& other) const {
+         return other < *this;
+      }
+      bool operator<=(const basic_iterator& other) const {
+         return !(other < *this);
+      }
+      bool operator>=(const basic_iterator& other) const {
+         return !(*this < other);
+      }
+
+    private:
+      friend class btree_slots<T>;
+      friend class basic_iterator<true>;
+
+      Owner owner;
+      size_t at;
+   };
+
+   typedef basic_iterator<false> iterator;
+   typedef basic_iterator<true>  const_iterator;
+
+   btree_slots() = default;
+
+   //Copies are packed: slot i holds the i-th smallest element
+   btree_slots(const btree_slots& other) {
+      assign(other.begin(), other.end());
+   }
+
+   btree_slots(btree_slots&&) = default;
+
+   btree_slots& operator=(const btree_slots& other) {
+      if (this != &other) {
+         assign(other.begin(), other.end());
+      }
+      return *this;
+   }
+
+   btree_slots& operator=(btree_slots&&) = default;
+
+   size_t size() const {
+      return order.size();
+   }
+   bool empty() const {
+      return order.empty();
+   }
+   void reserve(size_t n) {
+      slots.reserve(n);
+      order.reserve(n);
+   }
+   void clear() {
+      slots.clear();
+      order.clear();
+   }
+
+   T& operator[](size_t i) {
+      return slots[order[i]];
+   }
+   const T& operator[](size_t i) const {
+      return slots[order[i]];
+   }
+   T& front() {
+      return slots[order.front()];
+   }
+   const T& front() const {
+      return slots[order.front()];
+   }
+   T& back() {
+      return slots[order.back()];
+   }
+   const T& back() const {
+      return slots[order.back()];
+   }
+
+   iterator begin() {
+      return iterator(this, 0);
+   }
+   iterator end() {
+      return iterator(this, size());
+   }
+   const_iterator begin() const {
+      return const_iterator(this, 0);
+   }
+   const_iterator end() const {
+      return const_iterator(this, size());
+   }
+   const_iterator cbegin() const {
+      return begin();
+   }
+   const_iterator cend() const {
+      return end();
+   }
+
+   template <typename InputIt>
+   void assign(InputIt first, InputIt last) {
+      slots.assign(first, last);
+      order.resize(slots.size());
+      std::iota(order.begin(), order.end(), Slot{0});
+   }
+
+   template <typename U>
+   void push_back(U&& elem) {
+      slots.push_back(std::forward<U>(elem));
+      order.push_back(static_cast<Slot>(slots.size() - 1));
+   }
+
+  /**
+    * Places elem before pos in order. Only slot numbers shift; the
+    * element is constructed in a new slot and nothing else moves.
+    *
+    * @return an iterator to elem.
+    */
+   template <typename U>
+   iterator insert(const_iterator pos, U&& elem) {
+      size_t at = pos.at;
+      slots.push_back(std::forward<U>(elem));
+      order.insert(order.begin() + at, static_cast<Slot>(slots.size() - 1));
+      return iterator(this, at);
+   }
+
+  /**
+    * Removes the element at pos, moving the element in the last slot
+    * into its slot.
+    */
+   iterator erase(const_iterator pos) {
+      size_t at = pos.at;
+      Slot hole = order[at];
+      Slot last = static_cast<Slot>(slots.size() - 1);
+      if (hole != last) {
+         slots[hole] = std::move(slots[last]);
+         for (Slot& slot : order) {
+            if (slot == last) {
+               slot = hole;
+               break;
+            }
+         }
+      }
+      slots.pop_back();
+      order.erase(order.begin() + at);
+      return iterator(this, at);
+   }
+
+  /**
+    * Removes the elements in [first, last). Slots left free below the
+    * new size are refilled from the slots beyond it, so each element
+    * erased costs at most one move.
+    */
+   iterator erase(const_iterator first, const_iterator last) {
+      size_t from = first.at;
+      size_t to = last.at;
+      if (from == to) {
+         return iterator(this, from);
+      }
+      size_t kept = slots.size() - (to - from);
+      //where each slot sits in order, to repoint the ones that move
+      std::vector<size_t> rank(slots.size());
+      for (size_t i = 0; i < order.size(); ++i) {
+         rank[order[i]] = i;
+      }
+      std::vector<bool> freed(slots.size(), false);
+      for (size_t i = from; i < to; ++i) {
+         freed[order[i]] = true;
+      }
+      size_t source = kept;
+      for (size_t i = from; i < to; ++i) {
+         Slot hole = order[i];
+         if (hole >= kept) {
+            continue;
+         }
+         while (freed[source]) {
+            ++source;
+         }
+         slots[hole] = std::move(slots[source]);
+         order[rank[source]] = hole;
+         ++source;
+      }
+      slots.erase(slots.begin() + kept, slots.end());
+      order.erase(order.begin() + from, order.begin() + to);
+      return iterator(this, from);
+   }
+
+   void pop_back() {
+      erase(end() - 1);
+   }
+
+ private:
+   typedef uint32_t Slot;
+
+   //slots in no particular order; order[i] is the slot of the i-th
+   //smallest element
+   std::vector<T> slots;
+   std::vector<Slot> order;
+};
+
+// Whether btree nodes keep T in slots rather than in order.  Slots make
+// inserts and erases cheaper and searches dearer, as each probe goes
+// through the slot array; from about 256 bytes an element, shifting
+// costs more than that.  Specialise to choose otherwise for a type.
+template <typename T>
+struct btree_slotted : std::integral_constant<bool, (sizeof(T) >= 256)> {};
+
+// The sequence a btree node keeps its elements in: slots for large
+// elements, else a raw buffer for trivially copyable ones
+template <typename T>
+using btree_elements = typename std::conditional<
+      btree_slotted<T>::value, btree_slots<T>,
+      typename std::conditional<std::is_trivially_copyable<T>::value, btree_buffer<T>, std::vector<T>>::type>::type;
+
+#endif
@@ -0,0 +1,459 @@
+#ifndef BTREE_WAL_H
+#define BTREE_WAL_H
+
+/*
+ * Write-ahead logging for btree.
+ *
+ * btree_wal appends insert and erase records to a file.  Each record is
+ * framed by its length and a CRC-32, so a record torn by a crash is
+ * detected and dropped, along with anything after it, when the log is
+ * reopened.  Appending only buffers the record.  commit(lsn) makes it
+ * durable: the first waiting writer becomes the leader and writes and
+ * syncs everything buffered so far, covering every writer that arrived
+ * in the meantime, while the rest wait for it.  Concurrent writers thus
+ * share one fdatasync instead of paying for one each.
+ *
+ * durable_btree pairs a btree with a snapshot file (btree::save format)
+ * and a log.  On construction it loads the snapshot and replays the log
+ * on top of it, split across threads by key range.  checkpoint() writes
+ * a fresh snapshot and empties the log.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "btree.h"
+
+template <typename T>
+class btree_wal {
+ public:
+   enum class op : uint8_t { insert = 1, erase = 2 };
+
+   struct record {
+      op kind;
+      T elem;
+   };
+
+  /**
+    * Opens (or creates) the log at path.  Records already in the file
+    * are decoded and kept for recovered(); a torn or corrupt tail is
+    * cut off so new records follow the last good one.
+    *
+    * @param path the log file.
+    * @throws std::system_error on I/O failure.
+    */
+   explicit btree_wal(const std::string& path) {
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      if (fd < 0) {
+         throw std::system_error(errno, std::generic_category(), "btree_wal: open " + path);
+      }
+      try {
+         recover();
+      } catch (...) {
+         ::close(fd);
+         throw;
+      }
+   }
+
+   ~btree_wal() {
+      ::close(fd);
+   }
+
+   btree_wal(const btree_wal&) = delete;
+   btree_wal& operator=(const btree_wal&) = delete;
+
+   //Records found in the log when it was opened, oldest first
+   std::vector<record>& recovered() {
+      return replay;
+   }
+
+  /**
+    * Buffers a record.  It is not durable until commit is called with
+    * the returned sequence number (or a later one).
+    *
+    * @return the record's log sequence number.
+    */
+   uint64_t append(op kind, const T& elem) {
+      std::string payload(1, static_cast<char>(kind));
+      btree_codec<T>::encode(payload, elem, nullptr);
+      std::lock_guard<std::mutex> lock{mutex};
+      btree_bytes::putFixed<uint32_t>(pending, static_cast<uint32_t>(payload.size()));
+      btree_bytes::putFixed<uint32_t>(pending, btree_crc32(payload.data(), payload.size()));
+      pending += payload;
+      return ++appended;
+   }
+
+  /**
+    * Blocks until every record up to lsn is on disk.  One caller at a
+    * time writes and syncs the whole buffer on behalf of all waiters.
+    *
+    * @throws std::system_error if the write or sync fails; the log then
+    *         refuses further commits.
+    */
+   void commit(uint64_t lsn) {
+      std::unique_lock<std::mutex> lock{mutex};
+      while (durable < lsn) {
+         if (failed) {
+            throw std::system_error(EIO, std::generic_category(), "btree_wal: log failed earlier");
+         } else if (flushing) {
+            flushed.wait(lock);
+            continue;
+         }
+
+         flushing = true;
+         std::string batch;
+         batch.swap(pending);
+         uint64_t target = appended;
+         lock.unlock();
+         try {
+            writeAll(batch);
+            sync();
+         } catch (...) {
+            lock.lock();
+            failed = true;
+            flushing = false;
+            flushed.notify_all();
+            throw;
+         }
+         lock.lock();
+         durable = target;
+         flushing = false;
+         ++syncs;
+         flushed.notify_all();
+      }
+   }
+
+  /**
+    * Discards every record appended so far, once a checkpoint has made
+    * them redundant.  A commit already writing waits to finish first,
+    * so its batch cannot land after the truncation, and commits that
+    * arrive meanwhile wait for the reset; records appended meanwhile are
+    * kept for them.
+    *
+    * @throws std::system_error if truncating fails; the log then refuses
+    *         further commits.
+    */
+   void reset() {
+      std::unique_lock<std::mutex> lock{mutex};
+      flushed.wait(lock, [this] { return !flushing; });
+      if (failed) {
+         throw std::system_error(EIO, std::generic_category(), "btree_wal: log failed earlier");
+      }
+      flushing = true;
+      pending.clear();
+      uint64_t target = appended;
+      lock.unlock();
+      try {
+         if (::ftruncate(fd, 0) != 0 || ::lseek(fd, 0, SEEK_SET) < 0) {
+            throw std::system_error(errno, std::generic_category(), "btree_wal: truncate");
+         }
+         sync();
+      } catch (...) {
+         lock.lock();
+         failed = true;
+         flushing = false;
+         flushed.notify_all();
+         throw;
+      }
+      lock.lock();
+      durable = target;
+      flushing = false;
+      flushed.notify_all();
+   }
+
+   //Number of fdatasync calls made by commit
+   uint64_t sync_count() const {
+      std::lock_guard<std::mutex> lock{mutex};
+      return syncs;
+   }
+
+ private:
+   void recover() {
+      std::string contents;
+      char buf[1 << 16];
+      for (;;) {
+         ssize_t n = ::read(fd, buf, sizeof(buf));
+         if (n < 0 && errno == EINTR) {
+            continue;
+         } else if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "btree_wal: read");
+         } else if (n == 0) {
+            break;
+         }
+         contents.append(buf, n);
+      }
+
+      size_t good = 0;
+      while (contents.size() - good >= 8) {
+         uint32_t bytes = btree_bytes::getFixed<uint32_t>(&contents[good]);
+         uint32_t crc = btree_bytes::getFixed<uint32_t>(&contents[good + 4]);
+         if (bytes == 0 || contents.size() - good - 8 < bytes ||
+             btree_crc32(&contents[good + 8], bytes) != crc) {
+            break;
+         }
+         const char* in = &contents[good + 8];
+         const char* end = in + bytes;
+         op kind = static_cast<op>(*in++);
+         if (kind != op::insert && kind != op::erase) {
+            break;
+         }
+         try {
+            replay.push_back(record{kind, btree_codec<T>::decode(in, end, nullptr)});
+         } catch (const std::runtime_error&) {
+            break;
+         }
+         good += 8 + bytes;
+      }
+      if (good != contents.size() && ::ftruncate(fd, good) != 0) {
+         throw std::system_error(errno, std::generic_category(), "btree_wal: truncate");
+      }
+      if (::lseek(fd, good, SEEK_SET) < 0) {
+         throw std::system_error(errno, std::generic_category(), "btree_wal: seek");
+      }
+   }
+
+   void writeAll(const std::string& bytes) {
+      size_t done = 0;
+      while (done < bytes.size()) {
+         ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+         if (n < 0 && errno == EINTR) {
+            continue;
+         } else if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "btree_wal: write");
+         }
+         done += static_cast<size_t>(n);
+      }
+   }
+
+   void sync() {
+      if (::fdatasync(fd) != 0) {
+         throw std::system_error(errno, std::generic_category(), "btree_wal: fdatasync");
+      }
+   }
+
+   int fd;
+   std::vector<record> replay;
+
+   mutable std::mutex mutex;
+   std::condition_variable flushed;
+   std::string pending;
+   uint64_t appended = 0;
+   uint64_t durable = 0;
+   uint64_t syncs = 0;
+   bool flushing = false;
+   bool failed = false;
+};
+
+/*
+ * A btree whose updates survive the process.  insert and erase may be
+ * called from several threads at once; each returns only after its
+ * change is in the log.  Readers use tree() and must not run alongside
+ * writers.
+ */
+template <typename T, typename Augment = void>
+class durable_btree {
+ public:
+  /**
+    * Recovers the tree from snapshotPath and walPath, either of which
+    * may be missing.  Log records are partitioned by key range and each
+    * range is replayed on its own piece of the tree in parallel.
+    *
+    * @param snapshotPath where checkpoint() writes snapshots.
+    * @param walPath the log file.
+    * @param maxNodeElems node capacity when there is no snapshot yet.
+    * @param threads how many threads recovery may use.
+    */
+   durable_btree(const std::string& snapshotPath, const std::string& walPath,
+                 size_t maxNodeElems = 40,
+                 size_t threads = std::thread::hardware_concurrency())
+         : snapshot{snapshotPath}, wal{walPath}, data{maxNodeElems} {
+      std::ifstream in{snapshotPath, std::ios::binary};
+      if (in) {
+         data.load(in);
+      }
+      replay(wal.recovered(), std::max<size_t>(threads, 1));
+      wal.recovered().clear();
+      wal.recovered().shrink_to_fit();
+   }
+
+  /**
+    * Inserts elem and logs it.  Returns once the record is durable.
+    *
+    * @return whether elem was inserted (false if already present).
+    */
+   bool insert(const T& elem) {
+      uint64_t lsn;
+      {
+         std::lock_guard<std::mutex> lock{mutex};
+         if (!data.insert(elem).second) {
+            return false;
+         }
+         lsn = wal.append(btree_wal<T>::op::insert, elem);
+      }
+      wal.commit(lsn);
+      return true;
+   }
+
+  /**
+    * Erases elem and logs it.  Returns once the record is durable.
+    *
+    * @return the number of elements erased (0 or 1).
+    */
+   size_t erase(const T& elem) {
+      uint64_t lsn;
+      {
+         std::lock_guard<std::mutex> lock{mutex};
+         if (data.erase(elem) == 0) {
+            return 0;
+         }
+         lsn = wal.append(btree_wal<T>::op::erase, elem);
+      }
+      wal.commit(lsn);
+      return 1;
+   }
+
+  /**
+    * Writes a snapshot of the tree (via a temporary file and a rename,
+    * both synced to disk along with the directory) and then empties the
+    * log.  If the process dies between the two,
+    * the old log is replayed over the new snapshot on recovery, which
+    * is harmless: replaying a key's records leaves it as its last
+    * record says, whatever the snapshot held.
+    *
+    * @throws std::system_error or std::runtime_error if writing fails.
+    */
+   void checkpoint() {
+      std::lock_guard<std::mutex> lock{mutex};
+      std::string tmp = snapshot + ".tmp";
+      {
+         std::ofstream out{tmp, std::ios::binary | std::ios::trunc};
+         data.save(out);
+         out.close();
+         if (!out) {
+            throw std::runtime_error("durable_btree: cannot write " + tmp);
+         }
+      }
+      int fd = ::open(tmp.c_str(), O_RDONLY);
+      if (fd < 0 || ::fsync(fd) != 0) {
+         int err = errno;
+         if (fd >= 0) {
+            ::close(fd);
+         }
+         throw std::system_error(err, std::generic_category(), "durable_btree: sync " + tmp);
+      }
+      ::close(fd);
+      if (std::rename(tmp.c_str(), snapshot.c_str()) != 0) {
+         throw std::system_error(errno, std::generic_category(), "durable_btree: rename " + tmp);
+      }
+      //the rename must be on disk before the log is emptied, or a crash
+      //could bring back the old snapshot beside the truncated log
+      syncDirectory(snapshot);
+      wal.reset();
+   }
+
+   const btree<T, Augment>& tree() const {
+      return data;
+   }
+
+   const btree_wal<T>& log() const {
+      return wal;
+   }
+
+ private:
+   typedef typename btree_wal<T>::record record;
+
+   //Flushes the directory entry of path, so a rename into it survives a crash
+   static void syncDirectory(const std::string& path) {
+      size_t slash = path.rfind('/');
+      std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+      int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+      if (fd < 0 || ::fsync(fd) != 0) {
+         int err = errno;
+         if (fd >= 0) {
+            ::close(fd);
+         }
+         throw std::system_error(err, std::generic_category(), "durable_btree: sync " + dir);
+      }
+      ::close(fd);
+   }
+
+   void replay(std::vector<record>& records, size_t threads) {
+      if (records.empty()) {
+         return;
+      }
+
+      //pick up to threads - 1 distinct boundary keys at even quantiles
+      std::vector<T> bounds;
+      if (threads > 1 && records.size() >= 2 * threads) {
+         std::vector<T> keys;
+         keys.reserve(records.size());
+         for (const record& r : records) {
+            keys.push_back(r.elem);
+         }
+         std::sort(keys.begin(), keys.end());
+         keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+         for (size_t k = 1; k < threads && k * keys.size() / threads < keys.size(); ++k) {
+            const T& key = keys[k * keys.size() / threads];
+            if (bounds.empty() || bounds.back() < key) {
+               bounds.push_back(key);
+            }
+         }
+      }
+
+      //piece i holds keys in [bounds[i-1], bounds[i]); each key's records
+      //stay in log order within its piece
+      std::vector<btree<T, Augment>> pieces(bounds.size() + 1);
+      for (size_t i = bounds.size(); i > 0; --i) {
+         pieces[i] = data.split(bounds[i - 1]);
+      }
+      pieces[0] = std::move(data);
+      std::vector<std::vector<const record*>> work(pieces.size());
+      for (const record& r : records) {
+         work[std::upper_bound(bounds.begin(), bounds.end(), r.elem) - bounds.begin()].push_back(&r);
+      }
+
+      auto apply = [&](size_t i) {
+         for (const record* r : work[i]) {
+            if (r->kind == btree_wal<T>::op::insert) {
+               pieces[i].insert(r->elem);
+            } else {
+               pieces[i].erase(r->elem);
+            }
+         }
+      };
+      std::vector<std::thread> workers;
+      for (size_t i = 1; i < pieces.size(); ++i) {
+         workers.emplace_back(apply, i);
+      }
+      apply(0);
+      for (std::thread& w : workers) {
+         w.join();
+      }
+
+      data = std::move(pieces[0]);
+      for (size_t i = 1; i < pieces.size(); ++i) {
+         data = btree<T, Augment>::join(std::move(data), std::move(pieces[i]));
+      }
+   }
+
+   std::string snapshot;
+   btree_wal<T> wal;
+   btree<T, Augment> data;
+   std::mutex mutex;
+};
+
+#endif
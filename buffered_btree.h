@@ -0,0 +1,429 @@
+#ifndef BUFFERED_BTREE_H
+#define BUFFERED_BTREE_H
+
+/*
+ * A write-optimised (B-epsilon) tree.
+ *
+ * Elements live in sorted leaves; internal nodes hold pivots and a buffer
+ * of pending insert and erase messages.  A write only adds a message to
+ * the root's buffer.  When a buffer overflows, the messages bound for
+ * the child that would receive the most are moved down in one batch,
+ * merging into that child's buffer (or applying to it, if it is a leaf)
+ * and cascading if the child overflows in turn.  Each element is thus
+ * moved down with many others, so random writes touch far fewer nodes
+ * per element than descending the tree once for each.
+ *
+ * Queries see the messages still in flight: a lookup checks the buffer
+ * of each node on its path, the highest message for an element being
+ * the newest, and range scans overlay buffered messages on the elements
+ * below them.
+ *
+ * Writes are blind: insert and erase do not report whether the element
+ * was present, as finding out would need the descent buffering avoids.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class buffered_btree {
+ public:
+  /**
+    * @param nodeElems elements per leaf, and messages per internal
+    *        node buffer, before the node is split or flushed.
+    * @param fanout children per internal node before it is split.
+    */
+   explicit buffered_btree(size_t nodeElems = 256, size_t fanout = 16)
+         : leafMax{std::max<size_t>(nodeElems, 2)}, fanoutMax{std::max<size_t>(fanout, 2)},
+           bufferMax{std::max<size_t>(nodeElems, 1)}, root{new Node} {}
+
+  /**
+    * Inserts elem, replacing an equal element if there is one.
+    */
+   void insert(const T& elem) {
+      apply(Message{elem, false});
+   }
+
+  /**
+    * Erases elem if present.
+    */
+   void erase(const T& elem) {
+      apply(Message{elem, true});
+   }
+
+  /**
+    * Looks elem up, consulting the buffers on its path from the root.
+    *
+    * @return the stored element, or nothing if absent or erased.
+    */
+   std::optional<T> find(const T& elem) const {
+      const Node* node = root.get();
+      while (!node->leaf()) {
+         auto msg = std::lower_bound(node->buffer.begin(), node->buffer.end(), elem, MessageLess());
+         if (msg != node->buffer.end() && !(elem < msg->elem)) {
+            return msg->erase ? std::nullopt : std::optional<T>(msg->elem);
+         }
+         node = node->children[childFor(node, elem)].get();
+      }
+      auto it = std::lower_bound(node->elems.begin(), node->elems.end(), elem);
+      if (it != node->elems.end() && !(elem < *it)) {
+         return *it;
+      }
+      return std::nullopt;
+   }
+
+   bool contains(const T& elem) const {
+      return find(elem).has_value();
+   }
+
+  /**
+    * Calls fn, in ascending order, on every element in [lo, hi).
+    */
+   template <typename Function>
+   void range(const T& lo, const T& hi, Function fn) const {
+      std::vector<MessageRange> overlay;
+      scan(root.get(), &lo, &hi, overlay, fn);
+   }
+
+  /**
+    * Calls fn, in ascending order, on every element.
+    */
+   template <typename Function>
+   void for_each(Function fn) const {
+      std::vector<MessageRange> overlay;
+      scan(root.get(), nullptr, nullptr, overlay, fn);
+   }
+
+  /**
+    * Moves every buffered message down to the leaves.
+    */
+   void flush() {
+      if (!root->leaf()) {
+         flushAll(root.get());
+      }
+      settleRoot();
+   }
+
+   //messages waiting in internal node buffers
+   size_t buffered() const {
+      return pending;
+   }
+
+ private:
+   struct Message {
+      T elem;
+      bool erase;
+   };
+
+   struct MessageLess {
+      bool operator()(const Message& m, const T& elem) const {
+         return m.elem < elem;
+      }
+   };
+
+   //Sorted messages from one node's buffer
+   struct MessageRange {
+      const Message* first;
+      const Message* last;
+   };
+
+   //A leaf has no children. Child i of an internal node holds the
+   //elements in [pivots[i - 1], pivots[i])
+   struct Node {
+      bool leaf() const {
+         return children.empty();
+      }
+
+      std::vector<T> elems;
+      std::vector<T> pivots;
+      std::vector<std::unique_ptr<Node>> children;
+      //sorted, at most one message per element
+      std::vector<Message> buffer;
+   };
+
+   static size_t childFor(const Node* node, const T& elem) {
+      return std::upper_bound(node->pivots.begin(), node->pivots.end(), elem) - node->pivots.begin();
+   }
+
+   bool overflowing(const Node* node) const {
+      return node->leaf() ? node->elems.size() > leafMax : node->children.size() > fanoutMax;
+   }
+
+   void apply(const Message& msg) {
+      if (root->leaf()) {
+         applyToLeaf(root.get(), &msg, &msg + 1);
+      } else {
+         auto& buffer = root->buffer;
+         auto at = std::lower_bound(buffer.begin(), buffer.end(), msg.elem, MessageLess());
+         if (at != buffer.end() && !(msg.elem < at->elem)) {
+            *at = msg;
+         } else {
+            buffer.insert(at, msg);
+            ++pending;
+         }
+         while (root->buffer.size() > bufferMax) {
+            flushHeaviest(root.get());
+         }
+      }
+      settleRoot();
+   }
+
+   //Grows the tree while the root is too big, and drops roots left with
+   //a single child and nothing buffered
+   void settleRoot() {
+      while (overflowing(root.get())) {
+         std::unique_ptr<Node> top{new Node};
+         top->children.push_back(std::move(root));
+         root = std::move(top);
+         split(root.get(), 0);
+      }
+      while (!root->leaf() && root->children.size() == 1 && root->buffer.empty()) {
+         root = std::move(root->children.front());
+      }
+   }
+
+   //Moves the messages bound for the child that receives the most
+   void flushHeaviest(Node* node) {
+      size_t best = 0, bestBegin = 0, bestEnd = 0;
+      size_t begin = 0;
+      while (begin < node->buffer.size()) {
+         size_t c = childFor(node, node->buffer[begin].elem);
+         size_t end = begin + 1;
+         while (end < node->buffer.size() && (c == node->pivots.size() || node->buffer[end].elem < node->pivots[c])) {
+            ++end;
+         }
+         if (end - begin > bestEnd - bestBegin) {
+            best = c;
+            bestBegin = begin;
+            bestEnd = end;
+         }
+         begin = end;
+      }
+      pushDown(node, best, bestBegin, bestEnd, false);
+   }
+
+   //Moves every message below node to the leaves
+   void flushAll(Node* node) {
+      size_t begin = 0;
+      for (size_t c = 0; c < node->children.size();) {
+         size_t end = begin;
+         while (end < node->buffer.size() && (c == node->pivots.size() || node->buffer[end].elem < node->pivots[c])) {
+            ++end;
+         }
+         c += pushDown(node, c, begin, end, true);
+      }
+   }
+
+   //Moves node->buffer[begin, end) into child c, then splits or removes
+   //the child as needed. Returns how many children now stand in its place
+   size_t pushDown(Node* node, size_t c, size_t begin, size_t end, bool drain) {
+      Node* child = node->children[c].get();
+      const Message* first = node->buffer.data() + begin;
+      const Message* last = node->buffer.data() + end;
+      if (child->leaf()) {
+         applyToLeaf(child, first, last);
+         pending -= end - begin;
+      } else {
+         mergeIntoBuffer(child, first, last);
+         if (drain) {
+            flushAll(child);
+         } else {
+            while (child->buffer.size() > bufferMax) {
+               flushHeaviest(child);
+            }
+         }
+      }
+      node->buffer.erase(node->buffer.begin() + begin, node->buffer.begin() + end);
+
+      if (child->leaf() && child->elems.empty() && node->children.size() > 1) {
+         //the neighbour takes over the empty leaf's key range
+         node->pivots.erase(node->pivots.begin() + (c == 0 ? 0 : c - 1));
+         node->children.erase(node->children.begin() + c);
+         return 0;
+      }
+      return overflowing(child) ? split(node, c) : 1;
+   }
+
+   //Applies sorted messages to a leaf in one merge
+   static void applyToLeaf(Node* leaf, const Message* first, const Message* last) {
+      std::vector<T> merged;
+      merged.reserve(leaf->elems.size() + (last - first));
+      auto it = leaf->elems.begin();
+      for (; first != last; ++first) {
+         while (it != leaf->elems.end() && *it < first->elem) {
+            merged.push_back(std::move(*it++));
+         }
+         if (it != leaf->elems.end() && !(first->elem < *it)) {
+            ++it;
+         }
+         if (!first->erase) {
+            merged.push_back(first->elem);
+         }
+      }
+      std::move(it, leaf->elems.end(), std::back_inserter(merged));
+      leaf->elems.swap(merged);
+   }
+
+   //Merges sorted messages, newer than any in the child, into its buffer
+   void mergeIntoBuffer(Node* child, const Message* first, const Message* last) {
+      std::vector<Message> merged;
+      merged.reserve(child->buffer.size() + (last - first));
+      auto it = child->buffer.begin();
+      for (; first != last; ++first) {
+         while (it != child->buffer.end() && it->elem < first->elem) {
+            merged.push_back(std::move(*it++));
+         }
+         if (it != child->buffer.end() && !(first->elem < it->elem)) {
+            //superseded
+            ++it;
+            --pending;
+         }
+         merged.push_back(*first);
+      }
+      std::move(it, child->buffer.end(), std::back_inserter(merged));
+      child->buffer.swap(merged);
+   }
+
+   //Splits child c into as few nodes as fit, evenly filled. Returns the
+   //number of nodes
+   size_t split(Node* node, size_t c) {
+      std::unique_ptr<Node> child = std::move(node->children[c]);
+      size_t count = child->leaf() ? child->elems.size() : child->children.size();
+      size_t cap = child->leaf() ? leafMax : fanoutMax;
+      size_t parts = (count + cap - 1) / cap;
+
+      std::vector<std::unique_ptr<Node>> pieces;
+      std::vector<T> separators;
+      auto msg = child->buffer.begin();
+      for (size_t p = 0; p < parts; ++p) {
+         size_t from = count * p / parts;
+         size_t to = count * (p + 1) / parts;
+         std::unique_ptr<Node> piece{new Node};
+         if (child->leaf()) {
+            piece->elems.assign(std::make_move_iterator(child->elems.begin() + from),
+                                std::make_move_iterator(child->elems.begin() + to));
+            if (p != 0) {
+               separators.push_back(piece->elems.front());
+            }
+         } else {
+            for (size_t i = from; i < to; ++i) {
+               piece->children.push_back(std::move(child->children[i]));
+            }
+            piece->pivots.assign(child->pivots.begin() + from, child->pivots.begin() + (to - 1));
+            if (p != 0) {
+               separators.push_back(child->pivots[from - 1]);
+            }
+            auto msgEnd = to == count ? child->buffer.end()
+                                      : std::lower_bound(msg, child->buffer.end(), child->pivots[to - 1], MessageLess());
+            piece->buffer.assign(std::make_move_iterator(msg), std::make_move_iterator(msgEnd));
+            msg = msgEnd;
+         }
+         pieces.push_back(std::move(piece));
+      }
+
+      node->children[c] = std::move(pieces.front());
+      node->children.insert(node->children.begin() + c + 1, std::make_move_iterator(pieces.begin() + 1),
+                            std::make_move_iterator(pieces.end()));
+      node->pivots.insert(node->pivots.begin() + c, separators.begin(), separators.end());
+      return parts;
+   }
+
+   //Calls fn on the elements of node's subtree in [lo, hi), with the
+   //buffered messages applied, without gathering them first. overlay
+   //holds the messages from the buffers above node, newest first, already
+   //narrowed to node's keys and to [lo, hi). A null bound is open
+   template <typename Function>
+   static void scan(const Node* node, const T* lo, const T* hi, std::vector<MessageRange>& overlay, Function& fn) {
+      if (node->leaf()) {
+         const T* first = node->elems.data();
+         const T* last = first + node->elems.size();
+         if (lo != nullptr) {
+            first = std::lower_bound(first, last, *lo);
+         }
+         if (hi != nullptr) {
+            last = std::max(first, std::lower_bound(first, last, *hi));
+         }
+         mergeLeaf(first, last, overlay, fn);
+         return;
+      }
+
+      const Message* msg = node->buffer.data();
+      const Message* msgEnd = msg + node->buffer.size();
+      if (lo != nullptr) {
+         msg = std::lower_bound(msg, msgEnd, *lo, MessageLess());
+      }
+      if (hi != nullptr) {
+         msgEnd = std::max(msg, std::lower_bound(msg, msgEnd, *hi, MessageLess()));
+      }
+      //older than everything above, newer than everything below
+      overlay.push_back(MessageRange{msg, msgEnd});
+      std::vector<MessageRange> below(overlay.size());
+      for (size_t c = 0; c < node->children.size(); ++c) {
+         if (lo != nullptr && c < node->pivots.size() && !(*lo < node->pivots[c])) {
+            continue;
+         }
+         if (hi != nullptr && c > 0 && !(node->pivots[c - 1] < *hi)) {
+            break;
+         }
+         //child c takes each range's messages below its upper pivot
+         for (size_t r = 0; r < overlay.size(); ++r) {
+            const Message* split = c < node->pivots.size()
+                                      ? std::lower_bound(overlay[r].first, overlay[r].last, node->pivots[c], MessageLess())
+                                      : overlay[r].last;
+            below[r] = MessageRange{overlay[r].first, split};
+            overlay[r].first = split;
+         }
+         scan(node->children[c].get(), lo, hi, below, fn);
+      }
+      overlay.pop_back();
+   }
+
+   //Calls fn on the union of the leaf's elements [first, last) and the
+   //overlay's messages in order; for an element in several, the newest
+   //message decides whether it is there and which copy is seen
+   template <typename Function>
+   static void mergeLeaf(const T* first, const T* last, std::vector<MessageRange>& overlay, Function& fn) {
+      for (;;) {
+         const T* key = first != last ? first : nullptr;
+         for (const MessageRange& r : overlay) {
+            if (r.first != r.last && (key == nullptr || r.first->elem < *key)) {
+               key = &r.first->elem;
+            }
+         }
+         if (key == nullptr) {
+            return;
+         }
+         const Message* newest = nullptr;
+         for (MessageRange& r : overlay) {
+            if (r.first != r.last && !(*key < r.first->elem)) {
+               if (newest == nullptr) {
+                  newest = r.first;
+               }
+               ++r.first;
+            }
+         }
+         const T* elem = first;
+         if (first != last && !(*key < *first)) {
+            ++first;
+         }
+         if (newest == nullptr) {
+            fn(*elem);
+         } else if (!newest->erase) {
+            fn(newest->elem);
+         }
+      }
+   }
+
+   size_t leafMax;
+   size_t fanoutMax;
+   size_t bufferMax;
+   std::unique_ptr<Node> root;
+   size_t pending = 0;
+};
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef LSM_BTREE_H
+#define LSM_BTREE_H
+
+/*
+ * A log-structured merge tree built on btree.
+ *
+ * Writes go to a mutable memtable: a btree of present elements and a
+ * btree of tombstones for erased ones.  Once the memtable holds enough
+ * entries it is frozen into an immutable sorted run (a flat array, with
+ * a dead flag per entry, a Bloom filter and its key bounds) and a fresh
+ * memtable starts.  Runs pile up newest first; when there are too many,
+ * a background thread merges them k ways into one, the newest entry for
+ * each element winning and tombstones being dropped once nothing older
+ * remains for them to hide.
+ *
+ * Lookups consult the memtable and then each run from newest to oldest,
+ * skipping runs whose key bounds or filter rule the element out.  Range
+ * scans merge the memtable with every overlapping run.
+ *
+ * One thread uses the lsm_btree; only compaction runs alongside it.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "btree.h"
+#include "btree_filter.h"
+
+template <typename T, typename Hash = std::hash<T>>
+class lsm_btree {
+ public:
+  /**
+    * @param memtableLimit entries (elements plus tombstones) the memtable
+    *        holds before it is frozen into a run.
+    * @param maxRuns runs allowed before a background compaction merges
+    *        them into one.
+    * @param bitsPerKey Bloom filter bits per run entry.
+    * @param maxNodeElems node capacity of the memtable btrees.
+    */
+   explicit lsm_btree(size_t memtableLimit = 1 << 16, size_t maxRuns = 4,
+                      size_t bitsPerKey = 10, size_t maxNodeElems = 40)
+         : limit{std::max<size_t>(memtableLimit, 1)}, runLimit{std::max<size_t>(maxRuns, 2)},
+           filterBits{bitsPerKey}, nodeElems{maxNodeElems},
+           live{maxNodeElems}, dead{maxNodeElems} {}
+
+   ~lsm_btree() {
+      if (compactor.joinable()) {
+         compactor.join();
+      }
+   }
+
+   lsm_btree(const lsm_btree&) = delete;
+   lsm_btree& operator=(const lsm_btree&) = delete;
+
+  /**
+    * Inserts elem, shadowing any erase of it in an older run.
+    */
+   void insert(const T& elem) {
+      if (dead.erase(elem) != 0) {
+         //the tombstone's entry becomes the element's
+         live.insert(elem);
+      } else if (live.insert(elem).second) {
+         ++entries;
+         maybeFreeze();
+      }
+   }
+
+  /**
+    * Erases elem by recording a tombstone, which hides it in older runs.
+    */
+   void erase(const T& elem) {
+      if (live.erase(elem) != 0) {
+         //an older run may still hold elem, so the tombstone is needed
+         dead.insert(elem);
+      } else if (dead.insert(elem).second) {
+         ++entries;
+         maybeFreeze();
+      }
+   }
+
+  /**
+    * Looks elem up in the memtable, then in each run from newest to
+    * oldest whose bounds and filter admit it.
+    *
+    * @return the stored element, or nothing if absent or erased.
+    */
+   std::optional<T> find(const T& elem) const {
+      auto found = live.find(elem);
+      if (found != live.end()) {
+         return *found;
+      } else if (dead.find(elem) != dead.end()) {
+         return std::nullopt;
+      }
+      for (const auto& run : snapshotRuns()) {
+         if (elem < run->keys.front() || run->keys.back() < elem || !run->filter.may_contain(elem)) {
+            continue;
+         }
+         auto it = std::lower_bound(run->keys.begin(), run->keys.end(), elem);
+         if (it != run->keys.end() && *it == elem) {
+            size_t i = it - run->keys.begin();
+            return run->dead[i] ? std::nullopt : std::optional<T>(*it);
+         }
+      }
+      return std::nullopt;
+   }
+
+   bool contains(const T& elem) const {
+      return find(elem).has_value();
+   }
+
+  /**
+    * Calls fn, in ascending order, on every element in [lo, hi).
+    * Sources are merged k ways; for an element present in several the
+    * newest entry decides.
+    */
+   template <typename Function>
+   void range(const T& lo, const T& hi, Function fn) const {
+      //cursors are ranked by key, then by source age (memtable first)
+      std::vector<Cursor> cursors;
+      cursors.push_back(Cursor::fromTree(live, &lo, &hi, 0, false));
+      cursors.push_back(Cursor::fromTree(dead, &lo, &hi, 0, true));
+      auto runs = snapshotRuns();
+      for (size_t r = 0; r < runs.size(); ++r) {
+         const Run& run = *runs[r];
+         if (run.keys.back() < lo || !(run.keys.front() < hi)) {
+            continue;
+         }
+         cursors.push_back(Cursor::fromRun(run, &lo, &hi, r + 1));
+      }
+      mergeCursors(cursors, [&fn](const T& elem, bool erased) {
+         if (!erased) {
+            fn(elem);
+         }
+      });
+   }
+
+  /**
+    * Freezes the memtable into a run now, whatever its size.
+    */
+   void flush() {
+      if (entries != 0) {
+         freeze();
+      }
+   }
+
+  /**
+    * Merges every run into one on the calling thread, after waiting for
+    * any background compaction.
+    */
+   void compact() {
+      wait_compaction();
+      mergeRuns();
+   }
+
+   void wait_compaction() {
+      if (compactor.joinable()) {
+         compactor.join();
+      }
+   }
+
+   size_t run_count() const {
+      return snapshotRuns().size();
+   }
+
+   size_t memtable_entries() const {
+      return entries;
+   }
+
+ private:
+   struct Run {
+      std::vector<T> keys;
+      std::vector<bool> dead;
+      btree_bloom<T, Hash> filter;
+   };
+   typedef std::shared_ptr<const Run> RunPtr;
+
+   //A position in one sorted source during a merge. Sources are either
+   //a pair of memtable iterators or a slice of a run
+   struct Cursor {
+      const T* runAt = nullptr;
+      const T* runEnd = nullptr;
+      const Run* run = nullptr;
+      std::optional<typename btree<T>::const_iterator> treeAt;
+      std::optional<typename btree<T>::const_iterator> treeEnd;
+      const T* treeHi = nullptr;
+      bool tombstones = false;
+      size_t age = 0;
+
+      //A null bound is open
+      static Cursor fromTree(const btree<T>& tree, const T* lo, const T* hi, size_t age, bool tombstones) {
+         Cursor c;
+         c.treeAt = lo != nullptr ? tree.lower_bound(*lo) : tree.begin();
+         c.treeEnd = tree.end();
+         c.treeHi = hi;
+         c.tombstones = tombstones;
+         c.age = age;
+         return c;
+      }
+
+      static Cursor fromRun(const Run& run, const T* lo, const T* hi, size_t age) {
+         auto first = run.keys.begin();
+         auto last = run.keys.end();
+         Cursor c;
+         c.run = &run;
+         c.runAt = run.keys.data() + (lo != nullptr ? std::lower_bound(first, last, *lo) - first : 0);
+         c.runEnd = run.keys.data() + (hi != nullptr ? std::lower_bound(first, last, *hi) - first : last - first);
+         c.age = age;
+         return c;
+      }
+
+      bool done() const {
+         return treeAt ? *treeAt == *treeEnd || (treeHi != nullptr && !(**treeAt < *treeHi))
+                       : runAt == runEnd;
+      }
+      const T& key() const {
+         return treeAt ? **treeAt : *runAt;
+      }
+      bool erased() const {
+         return treeAt ? tombstones : run->dead[runAt - run->keys.data()];
+      }
+      void next() {
+         if (treeAt) {
+            ++*treeAt;
+         } else {
+            ++runAt;
+         }
+      }
+   };
+
+   //k-way merge of sorted cursors. fn sees each key once, with the
+   //erased flag of its youngest source
+   template <typename Function>
+   static void mergeCursors(std::vector<Cursor>& cursors, Function fn) {
+      auto later = [&cursors](size_t a, size_t b) {
+         const T& ka = cursors[a].key();
+         const T& kb = cursors[b].key();
+         return kb < ka || (!(ka < kb) && cursors[b].age < cursors[a].age);
+      };
+      std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+      for (size_t i = 0; i < cursors.size(); ++i) {
+         if (!cursors[i].done()) {
+            heap.push(i);
+         }
+      }
+      while (!heap.empty()) {
+         size_t top = heap.top();
+         heap.pop();
+         fn(cursors[top].key(), cursors[top].erased());
+         //skip the same key in older sources
+         while (!heap.empty() && !(cursors[top].key() < cursors[heap.top()].key())) {
+            size_t older = heap.top();
+            heap.pop();
+            cursors[older].next();
+            if (!cursors[older].done()) {
+               heap.push(older);
+            }
+         }
+         cursors[top].next();
+         if (!cursors[top].done()) {
+            heap.push(top);
+         }
+      }
+   }
+
+   std::vector<RunPtr> snapshotRuns() const {
+      std::lock_guard<std::mutex> lock{runsMutex};
+      return runs;
+   }
+
+   void maybeFreeze() {
+      if (entries >= limit) {
+         freeze();
+      }
+   }
+
+   //Turns the memtable into a run, newest of all
+   void freeze() {
+      auto run = std::make_shared<Run>();
+      run->keys.reserve(entries);
+      run->dead.reserve(entries);
+      std::vector<Cursor> cursors{Cursor::fromTree(live, nullptr, nullptr, 0, false),
+                                  Cursor::fromTree(dead, nullptr, nullptr, 0, true)};
+      mergeCursors(cursors, [&run](const T& elem, bool erased) {
+         run->keys.push_back(elem);
+         run->dead.push_back(erased);
+      });
+      run->filter = btree_bloom<T, Hash>(run->keys.size(), filterBits);
+      for (const T& elem : run->keys) {
+         run->filter.add(elem);
+      }
+
+      live = btree<T>(nodeElems);
+      dead = btree<T>(nodeElems);
+      entries = 0;
+
+      size_t count;
+      {
+         std::lock_guard<std::mutex> lock{runsMutex};
+         runs.insert(runs.begin(), std::move(run));
+         count = runs.size();
+      }
+      if (count > runLimit && !compacting.exchange(true)) {
+         if (compactor.joinable()) {
+            compactor.join();
+         }
+         compactor = std::thread([this] {
+            mergeRuns();
+            compacting = false;
+         });
+      }
+   }
+
+   //Merges the runs present now into one. Runs frozen meanwhile are
+   //newer and stay in front of the result. Nothing is older than the
+   //merged run, so its tombstones have nothing left to hide and go
+   void mergeRuns() {
+      std::vector<RunPtr> inputs = snapshotRuns();
+      if (inputs.size() < 2) {
+         return;
+      }
+      std::vector<Cursor> cursors;
+      size_t total = 0;
+      for (size_t r = 0; r < inputs.size(); ++r) {
+         cursors.push_back(Cursor::fromRun(*inputs[r], nullptr, nullptr, r));
+         total += inputs[r]->keys.size();
+      }
+      auto merged = std::make_shared<Run>();
+      merged->keys.reserve(total);
+      mergeCursors(cursors, [&merged](const T& elem, bool erased) {
+         if (!erased) {
+            merged->keys.push_back(elem);
+         }
+      });
+      merged->dead.assign(merged->keys.size(), false);
+      merged->filter = btree_bloom<T, Hash>(merged->keys.size(), filterBits);
+      for (const T& elem : merged->keys) {
+         merged->filter.add(elem);
+      }
+
+      std::lock_guard<std::mutex> lock{runsMutex};
+      //inputs are the oldest runs, at the back
+      runs.erase(runs.end() - inputs.size(), runs.end());
+      if (!merged->keys.empty()) {
+         runs.push_back(std::move(merged));
+      }
+   }
+
+   size_t limit;
+   size_t runLimit;
+   size_t filterBits;
+   size_t nodeElems;
+
+   btree<T> live;
+   btree<T> dead;
+   size_t entries = 0;
+
+   mutable std::mutex runsMutex;
+   std::vector<RunPtr> runs;
+   std::thread compactor;
+   std::atomic<bool> compacting{false};
+};
+
+#endif
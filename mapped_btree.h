@@ -0,0 +1,492 @@
+#ifndef MAPPED_BTREE_H
+#define MAPPED_BTREE_H
+
+/*
+ * A mapped_btree is a read-only btree that lives in a file image and is
+ * searched in place through mmap, so a replica can start answering
+ * queries as soon as the file is mapped, without deserialising anything.
+ *
+ * The image is written by mapped_btree<T>::write from a btree (or any
+ * sorted range).  It starts with a fixed header and is followed by
+ * fixed-size nodes in breadth-first order, the top levels sitting
+ * together at the front of the file.  Every link is an offset relative
+ * to the node that holds it, so the image is position independent and
+ * can be mapped anywhere.  T must be trivially copyable; elements are
+ * stored in their in-memory representation, so an image is only
+ * portable between machines of the same ABI.  An image is not trusted:
+ * the header is checked at open and each link as it is followed, so a
+ * corrupt one makes open, a search or an iterator step throw
+ * std::runtime_error rather than read outside the mapping.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "btree.h"
+
+template <typename T>
+class mapped_btree {
+   static_assert(std::is_trivially_copyable<T>::value,
+                 "mapped_btree stores elements as raw bytes");
+
+   struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t elemSize;
+      uint64_t count;
+      uint64_t nodeCount;
+      uint32_t maxNodeElems;
+      uint32_t nodeStride;
+      uint32_t valsOffset;
+      uint32_t reserved;
+      uint64_t rootOffset;
+   };
+
+   //Every node starts with this, then maxNodeElems + 1 child offsets,
+   //then (aligned for T) maxNodeElems element slots. Offsets are relative
+   //to the node's own address; 0 means no link
+   struct NodeHeader {
+      uint32_t count;
+      uint32_t slot;       // index of this node among its parent's children
+      int64_t parent;
+   };
+
+   static constexpr char imageMagic[8] = {'B', 'T', 'R', 'E', 'E', 'M', 'A', 'P'};
+   static constexpr uint32_t imageVersion = 1;
+   static constexpr size_t headerBytes = 64;
+
+   static_assert(sizeof(Header) <= headerBytes, "header outgrew its slot");
+
+ public:
+   class const_iterator {
+    public:
+      typedef std::ptrdiff_t                  difference_type;
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef const T                         value_type;
+      typedef const T*                        pointer;
+      typedef const T&                        reference;
+
+      const_iterator(): tree{nullptr}, node{nullptr}, pos{0} {}
+
+      reference operator*() const {
+         return tree->vals(node)[pos];
+      }
+      pointer operator->() const {
+         return &(operator*());
+      }
+
+      const_iterator& operator++() {
+         const char* child = tree->child(node, pos + 1);
+         if (child != nullptr) {
+            node = tree->leftmost(child);
+            pos = 0;
+         } else if (++pos == tree->header(node)->count) {
+            // climb until we arrive from a child that has an element to
+            // its right; running out of parents means we were at the end
+            while (pos == tree->header(node)->count) {
+               const NodeHeader* h = tree->header(node);
+               if (h->parent == 0) {
+                  node = nullptr;
+                  pos = 0;
+                  break;
+               }
+               pos = h->slot;
+               node = tree->parent(node);
+            }
+         }
+         return *this;
+      }
+
+      const_iterator operator++(int) {
+         const_iterator tmp{*this};
+         operator++();
+         return tmp;
+      }
+
+      const_iterator& operator--() {
+         if (node == nullptr) {
+            node = tree->rightmost(tree->root());
+            pos = tree->header(node)->count - 1;
+            return *this;
+         }
+         const char* child = tree->child(node, pos);
+         if (child != nullptr) {
+            node = tree->rightmost(child);
+            pos = tree->header(node)->count - 1;
+         } else {
+            while (pos == 0) {
+               pos = tree->header(node)->slot;
+               node = tree->parent(node);
+            }
+            --pos;
+         }
+         return *this;
+      }
+
+      const_iterator operator--(int) {
+         const_iterator tmp{*this};
+         operator--();
+         return tmp;
+      }
+
+      bool operator==(const const_iterator& other) const {
+         return node == other.node && pos == other.pos;
+      }
+      bool operator!=(const const_iterator& other) const {
+         return !operator==(other);
+      }
+
+    private:
+      friend class mapped_btree<T>;
+      const_iterator(const mapped_btree* t, const char* n, size_t p): tree{t}, node{n}, pos{p} {}
+
+      const mapped_btree* tree;
+      const char* node;
+      size_t pos;
+   };
+
+   typedef const_iterator                        iterator;
+   typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+   typedef const_reverse_iterator                reverse_iterator;
+
+  /**
+    * Maps the image at path for reading.
+    *
+    * @param path an image written by mapped_btree<T>::write.
+    * @throws std::system_error if the file cannot be opened or mapped,
+    *         std::runtime_error if it is not a valid image for T.
+    */
+   explicit mapped_btree(const std::string& path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+         throw std::system_error(errno, std::generic_category(), "mapped_btree: open " + path);
+      }
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+         int err = errno;
+         ::close(fd);
+         throw std::system_error(err, std::generic_category(), "mapped_btree: stat " + path);
+      }
+      length = static_cast<size_t>(st.st_size);
+      if (length < headerBytes) {
+         ::close(fd);
+         throw std::runtime_error("mapped_btree: " + path + " is too short to be an image");
+      }
+      void* addr = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+      int err = errno;
+      ::close(fd);
+      if (addr == MAP_FAILED) {
+         throw std::system_error(err, std::generic_category(), "mapped_btree: mmap " + path);
+      }
+      base = static_cast<const char*>(addr);
+
+      const Header* h = image();
+      if (std::memcmp(h->magic, imageMagic, sizeof(imageMagic)) != 0 || h->version != imageVersion ||
+          h->elemSize != sizeof(T) || h->maxNodeElems == 0 || h->maxNodeElems > UINT32_MAX / 2 ||
+          h->nodeStride != stride(h->maxNodeElems) || h->valsOffset != valuesOffset(h->maxNodeElems) ||
+          h->nodeCount > (length - headerBytes) / h->nodeStride ||
+          (h->count != 0 && !isNode(h->rootOffset, h->nodeCount, h->nodeStride))) {
+         unmap();
+         throw std::runtime_error("mapped_btree: " + path + " is not an image for this element type");
+      }
+      valsAt = h->valsOffset;
+   }
+
+   mapped_btree(const mapped_btree&) = delete;
+   mapped_btree& operator=(const mapped_btree&) = delete;
+
+   mapped_btree(mapped_btree&& other): base{other.base}, length{other.length}, valsAt{other.valsAt} {
+      other.base = nullptr;
+   }
+
+   mapped_btree& operator=(mapped_btree&& other) {
+      if (this != &other) {
+         unmap();
+         base = other.base;
+         length = other.length;
+         valsAt = other.valsAt;
+         other.base = nullptr;
+      }
+      return *this;
+   }
+
+   ~mapped_btree() {
+      unmap();
+   }
+
+  /**
+    * Lays out the elements of a btree as an image at path.  Internal
+    * nodes are filled completely and leaves evenly, so the image is as
+    * shallow as the node size allows.
+    *
+    * @param tree the btree to write out.
+    * @param path where to write the image; it is overwritten.
+    * @param maxNodeElems the number of elements per image node.
+    * @throws std::runtime_error if the image cannot be written.
+    */
+   template <typename Augment>
+   static void write(const btree<T, Augment>& tree, const std::string& path, size_t maxNodeElems = 64) {
+      write(tree.begin(), tree.end(), path, maxNodeElems);
+   }
+
+  /**
+    * As above, from a range that must be sorted and free of duplicates.
+    */
+   template <typename InputIt>
+   static void write(InputIt first, InputIt last, const std::string& path, size_t maxNodeElems = 64) {
+      if (maxNodeElems == 0 || maxNodeElems > UINT32_MAX / 2) {
+         throw std::invalid_argument("mapped_btree::write: bad node size");
+      }
+      std::vector<T> elems(first, last);
+
+      //Shape the tree breadth first, so node i of the list lands at
+      //offset headerBytes + i * stride
+      struct Draft {
+         size_t first, count, parent, slot;
+         std::vector<size_t> children;
+      };
+      std::vector<Draft> drafts;
+      if (!elems.empty()) {
+         drafts.push_back({0, elems.size(), 0, 0, {}});
+      }
+      for (size_t i = 0; i < drafts.size(); ++i) {
+         if (drafts[i].count <= maxNodeElems) {
+            continue;
+         }
+         size_t rest = drafts[i].count - maxNodeElems;
+         size_t start = drafts[i].first;
+         drafts[i].children.assign(maxNodeElems + 1, 0);
+         for (size_t c = 0; c <= maxNodeElems; ++c) {
+            size_t n = rest / (maxNodeElems + 1) + (c < rest % (maxNodeElems + 1) ? 1 : 0);
+            if (n != 0) {
+               drafts[i].children[c] = drafts.size();
+               drafts.push_back({start, n, i, c, {}});
+            }
+            start += n + 1;
+         }
+      }
+
+      size_t nodeStride = stride(maxNodeElems);
+      size_t valsOffset = valuesOffset(maxNodeElems);
+
+      std::string out(headerBytes, '\0');
+      Header h{};
+      std::memcpy(h.magic, imageMagic, sizeof(imageMagic));
+      h.version = imageVersion;
+      h.elemSize = sizeof(T);
+      h.count = elems.size();
+      h.nodeCount = drafts.size();
+      h.maxNodeElems = static_cast<uint32_t>(maxNodeElems);
+      h.nodeStride = static_cast<uint32_t>(nodeStride);
+      h.valsOffset = static_cast<uint32_t>(valsOffset);
+      h.rootOffset = drafts.empty() ? 0 : headerBytes;
+      std::memcpy(&out[0], &h, sizeof(h));
+
+      std::ofstream os(path, std::ios::binary | std::ios::trunc);
+      os.write(out.data(), out.size());
+      std::string node(nodeStride, '\0');
+      for (size_t i = 0; i < drafts.size(); ++i) {
+         const Draft& d = drafts[i];
+         std::fill(node.begin(), node.end(), '\0');
+         auto rel = [&](size_t target) {
+            return (static_cast<int64_t>(target) - static_cast<int64_t>(i)) * static_cast<int64_t>(nodeStride);
+         };
+
+         NodeHeader nh{};
+         nh.slot = static_cast<uint32_t>(d.slot);
+         nh.parent = i == 0 ? 0 : rel(d.parent);
+         std::vector<int64_t> links(maxNodeElems + 1, 0);
+         std::vector<T> vals;
+         if (d.children.empty()) {
+            vals.assign(elems.begin() + d.first, elems.begin() + d.first + d.count);
+         } else {
+            size_t start = d.first;
+            for (size_t c = 0; c <= maxNodeElems; ++c) {
+               const Draft* kid = d.children[c] != 0 ? &drafts[d.children[c]] : nullptr;
+               if (kid != nullptr) {
+                  links[c] = rel(d.children[c]);
+                  start += kid->count;
+               }
+               if (c < maxNodeElems) {
+                  vals.push_back(elems[start++]);
+               }
+            }
+         }
+         nh.count = static_cast<uint32_t>(vals.size());
+         std::memcpy(&node[0], &nh, sizeof(nh));
+         std::memcpy(&node[sizeof(NodeHeader)], links.data(), links.size() * sizeof(int64_t));
+         std::memcpy(&node[valsOffset], vals.data(), vals.size() * sizeof(T));
+         os.write(node.data(), node.size());
+      }
+      if (!os.flush()) {
+         throw std::runtime_error("mapped_btree::write: cannot write " + path);
+      }
+   }
+
+   size_t size() const {
+      return image()->count;
+   }
+   bool empty() const {
+      return size() == 0;
+   }
+
+   const_iterator begin() const {
+      return empty() ? end() : const_iterator(this, leftmost(root()), 0);
+   }
+   const_iterator end() const {
+      return const_iterator(this, nullptr, 0);
+   }
+   const_iterator cbegin() const {
+      return begin();
+   }
+   const_iterator cend() const {
+      return end();
+   }
+   const_reverse_iterator rbegin() const {
+      return const_reverse_iterator(end());
+   }
+   const_reverse_iterator rend() const {
+      return const_reverse_iterator(begin());
+   }
+
+  /**
+    * Returns an iterator to the matching element, or end() if there is
+    * none.  The search reads the mapping directly.
+    */
+   const_iterator find(const T& elem) const {
+      const char* node = empty() ? nullptr : root();
+      while (node != nullptr) {
+         const T* first = vals(node);
+         const T* last = first + header(node)->count;
+         const T* it = std::lower_bound(first, last, elem);
+         if (it != last && *it == elem) {
+            return const_iterator(this, node, it - first);
+         }
+         node = child(node, it - first);
+      }
+      return end();
+   }
+
+  /**
+    * Returns an iterator to the first element not less than elem, or
+    * end() if there is none.
+    */
+   const_iterator lower_bound(const T& elem) const {
+      const_iterator best = end();
+      const char* node = empty() ? nullptr : root();
+      while (node != nullptr) {
+         const T* first = vals(node);
+         const T* last = first + header(node)->count;
+         const T* it = std::lower_bound(first, last, elem);
+         if (it != last) {
+            best = const_iterator(this, node, it - first);
+            if (*it == elem) {
+               break;
+            }
+         }
+         node = child(node, it - first);
+      }
+      return best;
+   }
+
+ private:
+   static size_t valuesOffset(size_t maxNodeElems) {
+      size_t off = sizeof(NodeHeader) + (maxNodeElems + 1) * sizeof(int64_t);
+      return (off + alignof(T) - 1) / alignof(T) * alignof(T);
+   }
+
+   static size_t stride(size_t maxNodeElems) {
+      size_t align = std::max(alignof(T), alignof(int64_t));
+      size_t bytes = valuesOffset(maxNodeElems) + maxNodeElems * sizeof(T);
+      return (bytes + align - 1) / align * align;
+   }
+
+   const Header* image() const {
+      return reinterpret_cast<const Header*>(base);
+   }
+   const char* root() const {
+      return base + image()->rootOffset;
+   }
+
+   //Whether offset is where one of the image's nodes starts
+   static bool isNode(uint64_t offset, uint64_t nodeCount, uint64_t nodeStride) {
+      return offset >= headerBytes && (offset - headerBytes) % nodeStride == 0 &&
+             (offset - headerBytes) / nodeStride < nodeCount;
+   }
+
+   //Links are checked as they are followed rather than all at open, so
+   //opening stays as cheap as mapping. Children are laid out after their
+   //parent, so requiring children to lie ahead and parents behind also
+   //rules out cycles
+   const char* follow(const char* node, int64_t rel, bool down) const {
+      const Header* h = image();
+      uint64_t at = static_cast<uint64_t>(node - base);
+      bool ahead = rel > 0;
+      uint64_t distance = ahead ? static_cast<uint64_t>(rel) : 0 - static_cast<uint64_t>(rel);
+      if (rel == 0 || ahead != down || (ahead ? distance > length - at : distance > at) ||
+          !isNode(ahead ? at + distance : at - distance, h->nodeCount, h->nodeStride)) {
+         throw std::runtime_error("mapped_btree: corrupt link in image");
+      }
+      return node + rel;
+   }
+
+   const NodeHeader* header(const char* node) const {
+      const NodeHeader* h = reinterpret_cast<const NodeHeader*>(node);
+      if (h->count == 0 || h->count > image()->maxNodeElems || h->slot > image()->maxNodeElems) {
+         throw std::runtime_error("mapped_btree: corrupt node in image");
+      }
+      return h;
+   }
+
+   //The node node hangs off
+   const char* parent(const char* node) const {
+      return follow(node, header(node)->parent, false);
+   }
+   const T* vals(const char* node) const {
+      return reinterpret_cast<const T*>(node + valsAt);
+   }
+   const char* child(const char* node, size_t i) const {
+      int64_t rel;
+      std::memcpy(&rel, node + sizeof(NodeHeader) + i * sizeof(int64_t), sizeof(rel));
+      return rel == 0 ? nullptr : follow(node, rel, true);
+   }
+   const char* leftmost(const char* node) const {
+      for (const char* c = child(node, 0); c != nullptr; c = child(node, 0)) {
+         node = c;
+      }
+      return node;
+   }
+   const char* rightmost(const char* node) const {
+      for (const char* c = child(node, header(node)->count); c != nullptr; c = child(node, header(node)->count)) {
+         node = c;
+      }
+      return node;
+   }
+
+   void unmap() {
+      if (base != nullptr) {
+         ::munmap(const_cast<char*>(base), length);
+         base = nullptr;
+      }
+   }
+
+   const char* base = nullptr;
+   size_t length = 0;
+   size_t valsAt = 0;
+};
+
+#endif
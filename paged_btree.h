@@ -0,0 +1,1064 @@
+#ifndef PAGED_BTREE_H
+#define PAGED_BTREE_H
+
+/*
+ * A paged_btree keeps its nodes in fixed-size pages of a file rather
+ * than on the heap, so it can hold more elements than fit in memory.
+ * Pages are reached through a buffer_pool that caches a bounded number
+ * of them, evicting with the clock algorithm and writing dirty pages
+ * back as they leave.  The tree itself grows exactly like btree: an
+ * element goes into the first node on its search path with room, and a
+ * full node sprouts a child in the slot the element falls into.
+ *
+ * Pages move through a page_io.  Where the kernel supports it that is
+ * an io_uring, so batches of reads and write-backs (flushes, and the
+ * pages an iterator's scan reaches next, prefetched a window at a time)
+ * are in flight together; otherwise plain pread/pwrite.
+ *
+ * Page 0 of the file holds the tree's metadata; node pages follow.
+ * Links between nodes are 32-bit page numbers, 0 meaning no link.
+ * T must be trivially copyable; elements are stored as raw bytes.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(IORING_FEAT_SINGLE_MMAP)
+#define PAGED_BTREE_HAS_URING 1
+#endif
+#endif
+
+typedef uint32_t page_id;
+
+// How the buffer pool moves pages between memory and the file
+class page_io {
+ public:
+   explicit page_io(size_t pageSize): pageBytes{pageSize} {}
+   virtual ~page_io() = default;
+
+   size_t page_size() const {
+      return pageBytes;
+   }
+
+   //Number of whole pages in the file
+   virtual page_id page_count() const = 0;
+   virtual void read(page_id id, char* buf) = 0;
+   virtual void write(page_id id, const char* buf) = 0;
+   virtual void sync() = 0;
+
+   //Reads n pages; implementations may keep all of them in flight at once
+   virtual void read_batch(const page_id* ids, char* const* bufs, size_t n) {
+      for (size_t i = 0; i < n; ++i) {
+         read(ids[i], bufs[i]);
+      }
+   }
+
+   //Writes n pages; implementations may keep all of them in flight at once
+   virtual void write_batch(const page_id* ids, const char* const* bufs, size_t n) {
+      for (size_t i = 0; i < n; ++i) {
+         write(ids[i], bufs[i]);
+      }
+   }
+
+ protected:
+   size_t pageBytes;
+};
+
+// Blocking pread/pwrite on a file descriptor
+class sync_page_io : public page_io {
+ public:
+   sync_page_io(const std::string& path, size_t pageSize): page_io{pageSize} {
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      if (fd < 0) {
+         throw std::system_error(errno, std::generic_category(), "page_io: open " + path);
+      }
+   }
+
+   ~sync_page_io() override {
+      ::close(fd);
+   }
+
+   sync_page_io(const sync_page_io&) = delete;
+   sync_page_io& operator=(const sync_page_io&) = delete;
+
+   page_id page_count() const override {
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+         throw std::system_error(errno, std::generic_category(), "page_io: stat");
+      }
+      return static_cast<page_id>(static_cast<size_t>(st.st_size) / pageBytes);
+   }
+
+   void read(page_id id, char* buf) override {
+      size_t done = 0;
+      while (done < pageBytes) {
+         ssize_t n = ::pread(fd, buf + done, pageBytes - done, offset(id) + done);
+         if (n < 0 && errno == EINTR) {
+            continue;
+         } else if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "page_io: read");
+         } else if (n == 0) {
+            // past the end of the file: the page was allocated but never written
+            std::memset(buf + done, 0, pageBytes - done);
+            break;
+         }
+         done += static_cast<size_t>(n);
+      }
+   }
+
+   void write(page_id id, const char* buf) override {
+      size_t done = 0;
+      while (done < pageBytes) {
+         ssize_t n = ::pwrite(fd, buf + done, pageBytes - done, offset(id) + done);
+         if (n < 0 && errno == EINTR) {
+            continue;
+         } else if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "page_io: write");
+         }
+         done += static_cast<size_t>(n);
+      }
+   }
+
+   void sync() override {
+      if (::fdatasync(fd) != 0) {
+         throw std::system_error(errno, std::generic_category(), "page_io: fdatasync");
+      }
+   }
+
+ protected:
+   off_t offset(page_id id) const {
+      return static_cast<off_t>(id) * static_cast<off_t>(pageBytes);
+   }
+
+   int fd;
+};
+
+#ifdef PAGED_BTREE_HAS_URING
+/*
+ * Page I/O through an io_uring, driven with raw system calls so no
+ * liburing is needed.  A batch of reads or writes is submitted with a
+ * single io_uring_enter and reaped as the completions arrive, so many
+ * page transfers are in flight at once.  Requests the kernel cannot
+ * serve this way (old kernels lacking IORING_OP_READ/WRITE, short
+ * transfers) are redone with pread/pwrite.
+ */
+class uring_page_io : public sync_page_io {
+ public:
+  /**
+    * @param path the backing file.
+    * @param pageSize bytes per page.
+    * @param entries submission queue size, the most requests in flight.
+    * @throws std::system_error if the file cannot be opened or the ring
+    *         cannot be set up (for instance when io_uring is disabled).
+    */
+   uring_page_io(const std::string& path, size_t pageSize, unsigned entries = 64)
+         : sync_page_io{path, pageSize} {
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+      ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+      if (ringFd < 0) {
+         throw std::system_error(errno, std::generic_category(), "uring_page_io: io_uring_setup");
+      }
+
+      try {
+         mapRings(params);
+      } catch (...) {
+         release();
+         throw;
+      }
+   }
+
+   ~uring_page_io() override {
+      release();
+   }
+
+   void read(page_id id, char* buf) override {
+      read_batch(&id, &buf, 1);
+   }
+
+   void write(page_id id, const char* buf) override {
+      write_batch(&id, &buf, 1);
+   }
+
+   void read_batch(const page_id* ids, char* const* bufs, size_t n) override {
+      transfer(IORING_OP_READ, ids, const_cast<char**>(bufs), n);
+   }
+
+   void write_batch(const page_id* ids, const char* const* bufs, size_t n) override {
+      transfer(IORING_OP_WRITE, ids, const_cast<char**>(bufs), n);
+   }
+
+ private:
+   void mapRings(const io_uring_params& params) {
+      sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (single) {
+         sqBytes = cqBytes = std::max(sqBytes, cqBytes);
+      }
+      sqRing = map(sqBytes, IORING_OFF_SQ_RING);
+      cqRing = single ? sqRing : map(cqBytes, IORING_OFF_CQ_RING);
+      sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+      sqes = static_cast<io_uring_sqe*>(map(sqeBytes, IORING_OFF_SQES));
+
+      char* sq = static_cast<char*>(sqRing);
+      sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+      sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+      sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+      sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+      sqSize = params.sq_entries;
+      char* cq = static_cast<char*>(cqRing);
+      cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+      cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+      cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+   }
+
+   void* map(size_t bytes, off_t offset) {
+      void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+      if (p == MAP_FAILED) {
+         throw std::system_error(errno, std::generic_category(), "uring_page_io: mmap");
+      }
+      return p;
+   }
+
+   void release() {
+      if (sqes != nullptr) {
+         ::munmap(sqes, sqeBytes);
+      }
+      if (cqRing != nullptr && cqRing != sqRing) {
+         ::munmap(cqRing, cqBytes);
+      }
+      if (sqRing != nullptr) {
+         ::munmap(sqRing, sqBytes);
+      }
+      ::close(ringFd);
+   }
+
+   //Submits the requests in chunks of at most sqSize and waits for all
+   //of them; short or unsupported ones are redone synchronously.  On an
+   //error the rest of the batch is still reaped, since the kernel may be
+   //filling buffers the caller gets back once this throws.  If entering
+   //the ring fails, the entries the kernel has not taken are withdrawn
+   //so no later call submits them, and those it took are waited for
+   void transfer(uint8_t opcode, const page_id* ids, char** bufs, size_t n) {
+      std::exception_ptr error;
+      for (size_t done = 0; done < n && !error;) {
+         unsigned batch = static_cast<unsigned>(std::min<size_t>(n - done, sqSize));
+         unsigned tail = *sqTail;
+         for (unsigned i = 0; i < batch; ++i) {
+            unsigned index = (tail + i) & sqMask;
+            io_uring_sqe& sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = opcode;
+            sqe.fd = fd;
+            sqe.addr = reinterpret_cast<uint64_t>(bufs[done + i]);
+            sqe.len = static_cast<uint32_t>(pageBytes);
+            sqe.off = static_cast<uint64_t>(offset(ids[done + i]));
+            sqe.user_data = done + i;
+            sqArray[index] = index;
+         }
+         __atomic_store_n(sqTail, tail + batch, __ATOMIC_RELEASE);
+
+         unsigned expected = batch;
+         unsigned submitted = 0;
+         unsigned reaped = 0;
+         while (reaped < expected) {
+            int r = static_cast<int>(::syscall(__NR_io_uring_enter, ringFd, expected - submitted,
+                                               expected - reaped, IORING_ENTER_GETEVENTS, nullptr, 0));
+            int err = errno;
+            //the kernel advances the head past each entry it takes
+            submitted = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) - tail;
+            if (r < 0 && err != EINTR) {
+               if (submitted != expected) {
+                  __atomic_store_n(sqTail, tail + submitted, __ATOMIC_RELEASE);
+                  expected = submitted;
+               }
+               if (!error) {
+                  error = std::make_exception_ptr(
+                        std::system_error(err, std::generic_category(), "uring_page_io: io_uring_enter"));
+               }
+               //completions still reach the ring without waiting in the kernel
+               ::sched_yield();
+            }
+
+            unsigned head = *cqHead;
+            unsigned ready = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != ready; ++head, ++reaped) {
+               const io_uring_cqe& cqe = cqes[head & cqMask];
+               size_t i = static_cast<size_t>(cqe.user_data);
+               if (cqe.res == static_cast<int>(pageBytes) || error) {
+                  continue;
+               }
+               try {
+                  if (cqe.res < 0 && cqe.res != -EINVAL && cqe.res != -EOPNOTSUPP) {
+                     throw std::system_error(-cqe.res, std::generic_category(), "uring_page_io: transfer");
+                  } else if (opcode == IORING_OP_READ) {
+                     sync_page_io::read(ids[i], bufs[i]);
+                  } else {
+                     sync_page_io::write(ids[i], bufs[i]);
+                  }
+               } catch (...) {
+                  error = std::current_exception();
+               }
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+         }
+         done += batch;
+      }
+      if (error) {
+         std::rethrow_exception(error);
+      }
+   }
+
+   int ringFd = -1;
+   void* sqRing = nullptr;
+   void* cqRing = nullptr;
+   io_uring_sqe* sqes = nullptr;
+   size_t sqBytes = 0;
+   size_t cqBytes = 0;
+   size_t sqeBytes = 0;
+   unsigned* sqHead = nullptr;
+   unsigned* sqTail = nullptr;
+   unsigned* sqArray = nullptr;
+   unsigned sqMask = 0;
+   unsigned sqSize = 0;
+   unsigned* cqHead = nullptr;
+   unsigned* cqTail = nullptr;
+   unsigned cqMask = 0;
+   io_uring_cqe* cqes = nullptr;
+};
+#endif
+
+//The fastest page_io available: io_uring where the kernel allows it,
+//pread/pwrite otherwise
+inline std::unique_ptr<page_io> make_page_io(const std::string& path, size_t pageSize) {
+#ifdef PAGED_BTREE_HAS_URING
+   try {
+      return std::unique_ptr<page_io>(new uring_page_io(path, pageSize));
+   } catch (const std::system_error&) {
+   }
+#endif
+   return std::unique_ptr<page_io>(new sync_page_io(path, pageSize));
+}
+
+/*
+ * A fixed number of in-memory frames caching file pages.  A page stays
+ * put while it is pinned; unpinned pages are candidates for eviction,
+ * chosen by a clock hand that gives recently used pages a second chance.
+ * Dirty pages are written back when evicted and on flush().
+ */
+class buffer_pool {
+ public:
+   struct stats {
+      size_t hits = 0;
+      size_t misses = 0;
+      size_t evictions = 0;
+      size_t writebacks = 0;
+      size_t prefetched = 0;
+   };
+
+   buffer_pool(std::unique_ptr<page_io> pageIo, size_t capacity)
+         : io{std::move(pageIo)}, frames(std::max<size_t>(capacity, 1)),
+           memory(frames.size() * io->page_size()) {
+      table.reserve(frames.size());
+   }
+
+   buffer_pool(const buffer_pool&) = delete;
+   buffer_pool& operator=(const buffer_pool&) = delete;
+
+   size_t page_size() const {
+      return io->page_size();
+   }
+   size_t capacity() const {
+      return frames.size();
+   }
+   const stats& statistics() const {
+      return counters;
+   }
+   page_io& device() {
+      return *io;
+   }
+
+   //Returns the page's bytes, reading it in if needed. Each pin must be
+   //matched by an unpin
+   char* pin(page_id id) {
+      auto found = table.find(id);
+      if (found != table.end()) {
+         ++counters.hits;
+         Frame& f = frames[found->second];
+         ++f.pins;
+         f.referenced = true;
+         return data(found->second);
+      }
+      ++counters.misses;
+      size_t slot = claim(id);
+      try {
+         io->read(id, data(slot));
+      } catch (...) {
+         //the frame holds no page after all, as in prefetch
+         frames[slot] = Frame();
+         table.erase(id);
+         throw;
+      }
+      return data(slot);
+   }
+
+   //As pin, for a page that has never been written: it is zero-filled
+   //in memory instead of being read
+   char* pin_new(page_id id) {
+      size_t slot = claim(id);
+      std::memset(data(slot), 0, page_size());
+      frames[slot].dirty = true;
+      return data(slot);
+   }
+
+   void unpin(page_id id) {
+      --frames[table.at(id)].pins;
+   }
+
+   void mark_dirty(page_id id) {
+      frames[table.at(id)].dirty = true;
+   }
+
+   //Whether the page is in the pool; not counted as a hit or a miss
+   bool cached(page_id id) const {
+      return table.count(id) != 0;
+   }
+
+  /**
+    * Starts reading the given pages into free or evictable frames, all
+    * in one batch, so later pins of them are hits.  Pages already cached
+    * are skipped, and at most a quarter of the pool is used so a
+    * prefetch never crowds out the working set.
+    */
+   void prefetch(const page_id* ids, size_t n) {
+      std::vector<page_id> wanted;
+      std::vector<char*> bufs;
+      size_t limit = std::max<size_t>(frames.size() / 4, 1);
+      for (size_t i = 0; i < n && wanted.size() < limit; ++i) {
+         if (ids[i] == 0 || table.count(ids[i]) != 0 ||
+             std::find(wanted.begin(), wanted.end(), ids[i]) != wanted.end()) {
+            continue;
+         }
+         size_t slot = victim();
+         if (slot == frames.size()) {
+            break;
+         }
+         claim(slot, ids[i]);
+         wanted.push_back(ids[i]);
+         bufs.push_back(data(slot));
+      }
+      if (wanted.empty()) {
+         return;
+      }
+      try {
+         io->read_batch(wanted.data(), bufs.data(), wanted.size());
+      } catch (...) {
+         for (page_id id : wanted) {
+            frames[table[id]] = Frame();
+            table.erase(id);
+         }
+         throw;
+      }
+      for (page_id id : wanted) {
+         Frame& f = frames[table[id]];
+         f.pins = 0;
+         //not referenced yet: an unused prefetch is the first to go
+         f.referenced = false;
+      }
+      counters.prefetched += wanted.size();
+   }
+
+   //Writes every dirty page back, in one batch, and syncs the file
+   void flush() {
+      std::vector<page_id> ids;
+      std::vector<const char*> bufs;
+      for (size_t slot = 0; slot < frames.size(); ++slot) {
+         if (frames[slot].valid && frames[slot].dirty) {
+            ids.push_back(frames[slot].id);
+            bufs.push_back(data(slot));
+         }
+      }
+      io->write_batch(ids.data(), bufs.data(), ids.size());
+      for (page_id id : ids) {
+         frames[table[id]].dirty = false;
+      }
+      counters.writebacks += ids.size();
+      io->sync();
+   }
+
+ protected:
+   struct Frame {
+      page_id id = 0;
+      uint32_t pins = 0;
+      bool valid = false;
+      bool dirty = false;
+      bool referenced = false;
+   };
+
+   char* data(size_t slot) {
+      return memory.data() + slot * page_size();
+   }
+
+   void writeBack(size_t slot) {
+      Frame& f = frames[slot];
+      if (f.valid && f.dirty) {
+         io->write(f.id, data(slot));
+         f.dirty = false;
+         ++counters.writebacks;
+      }
+   }
+
+   //Picks a frame for page id, evicting its current page if necessary,
+   //and returns it pinned once
+   size_t claim(page_id id) {
+      size_t slot = victim();
+      if (slot == frames.size()) {
+         throw std::runtime_error("buffer_pool: every frame is pinned");
+      }
+      claim(slot, id);
+      return slot;
+   }
+
+   void claim(size_t slot, page_id id) {
+      Frame& f = frames[slot];
+      if (f.valid) {
+         writeBack(slot);
+         table.erase(f.id);
+         ++counters.evictions;
+      }
+      f.id = id;
+      f.pins = 1;
+      f.valid = true;
+      f.dirty = false;
+      f.referenced = true;
+      table[id] = slot;
+   }
+
+   //The frame to reuse next, or frames.size() if all are pinned
+   size_t victim() {
+      //two sweeps clear every reference bit, so a third finding nothing
+      //means every frame is pinned
+      for (size_t step = 0; step < 3 * frames.size(); ++step) {
+         size_t slot = hand;
+         hand = (hand + 1) % frames.size();
+         Frame& f = frames[slot];
+         if (!f.valid) {
+            return slot;
+         } else if (f.pins != 0) {
+            continue;
+         } else if (f.referenced) {
+            f.referenced = false;
+            continue;
+         }
+         return slot;
+      }
+      return frames.size();
+   }
+
+   std::unique_ptr<page_io> io;
+   std::vector<Frame> frames;
+   std::vector<char> memory;
+   std::unordered_map<page_id, size_t> table;
+   size_t hand = 0;
+   stats counters;
+};
+
+// Keeps a page pinned for as long as it lives
+class page_ref {
+ public:
+   page_ref() = default;
+   page_ref(buffer_pool* p, page_id i): pool{p}, id{i}, bytes{p->pin(i)} {}
+
+   page_ref(const page_ref& other): pool{other.pool}, id{other.id}, bytes{other.bytes} {
+      if (pool != nullptr) {
+         pool->pin(id);
+      }
+   }
+   page_ref(page_ref&& other): pool{other.pool}, id{other.id}, bytes{other.bytes} {
+      other.pool = nullptr;
+   }
+   page_ref& operator=(page_ref other) {
+      std::swap(pool, other.pool);
+      std::swap(id, other.id);
+      std::swap(bytes, other.bytes);
+      return *this;
+   }
+   ~page_ref() {
+      if (pool != nullptr) {
+         pool->unpin(id);
+      }
+   }
+
+   //Wraps a page pinned with pin_new
+   static page_ref adopt(buffer_pool* p, page_id i, char* b) {
+      page_ref ref;
+      ref.pool = p;
+      ref.id = i;
+      ref.bytes = b;
+      return ref;
+   }
+
+   explicit operator bool() const {
+      return pool != nullptr;
+   }
+   page_id page() const {
+      return id;
+   }
+   char* data() const {
+      return bytes;
+   }
+   void mark_dirty() const {
+      pool->mark_dirty(id);
+   }
+
+ private:
+   buffer_pool* pool = nullptr;
+   page_id id = 0;
+   char* bytes = nullptr;
+};
+
+template <typename T>
+class paged_btree {
+   static_assert(std::is_trivially_copyable<T>::value,
+                 "paged_btree stores elements as raw bytes");
+
+   //Page 0
+   struct Meta {
+      char magic[8];
+      uint32_t version;
+      uint32_t pageSize;
+      uint32_t elemSize;
+      uint32_t maxNodeElems;
+      page_id root;
+      page_id pageCount;
+      uint64_t count;
+   };
+
+   //Start of every node page, followed by maxNodeElems + 1 child page
+   //numbers and then (aligned for T) the element slots
+   struct NodeHeader {
+      uint32_t count;
+      page_id parent;
+      uint32_t slot;       // index of this node among its parent's children
+      uint32_t reserved;
+   };
+
+   static constexpr char fileMagic[8] = {'B', 'T', 'R', 'E', 'P', 'A', 'G', 'E'};
+   static constexpr uint32_t fileVersion = 1;
+
+ public:
+   class const_iterator {
+    public:
+      typedef std::ptrdiff_t                  difference_type;
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef const T                         value_type;
+      typedef const T*                        pointer;
+      typedef const T&                        reference;
+
+      const_iterator(): tree{nullptr}, pos{0} {}
+
+      reference operator*() const {
+         return tree->vals(page.data())[pos];
+      }
+      pointer operator->() const {
+         return &(operator*());
+      }
+
+      const_iterator& operator++() {
+         page_id child = tree->child(page.data(), pos + 1);
+         if (child != 0) {
+            tree->scanAhead(page.data(), pos + 1, true);
+            page = tree->leftmost(child, true);
+            pos = 0;
+         } else if (++pos == tree->header(page.data())->count) {
+            while (pos == tree->header(page.data())->count) {
+               const NodeHeader* h = tree->header(page.data());
+               if (h->parent == 0) {
+                  page = page_ref();
+                  pos = 0;
+                  break;
+               }
+               pos = h->slot;
+               page = tree->fetch(h->parent);
+            }
+         }
+         return *this;
+      }
+
+      const_iterator operator++(int) {
+         const_iterator tmp{*this};
+         operator++();
+         return tmp;
+      }
+
+      const_iterator& operator--() {
+         if (!page) {
+            page = tree->rightmost(tree->meta().root, true);
+            pos = tree->header(page.data())->count - 1;
+            return *this;
+         }
+         page_id child = tree->child(page.data(), pos);
+         if (child != 0) {
+            tree->scanAhead(page.data(), pos, false);
+            page = tree->rightmost(child, true);
+            pos = tree->header(page.data())->count - 1;
+         } else {
+            while (pos == 0) {
+               const NodeHeader* h = tree->header(page.data());
+               pos = h->slot;
+               page = tree->fetch(h->parent);
+            }
+            --pos;
+         }
+         return *this;
+      }
+
+      const_iterator operator--(int) {
+         const_iterator tmp{*this};
+         operator--();
+         return tmp;
+      }
+
+      bool operator==(const const_iterator& other) const {
+         return page.page() == other.page.page() && pos == other.pos;
+      }
+      bool operator!=(const const_iterator& other) const {
+         return !operator==(other);
+      }
+
+    private:
+      friend class paged_btree<T>;
+      const_iterator(const paged_btree* t, page_ref p, size_t i): tree{t}, page{std::move(p)}, pos{i} {}
+
+      const paged_btree* tree;
+      page_ref page;
+      size_t pos;
+   };
+
+   typedef const_iterator                        iterator;
+   typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+   typedef const_reverse_iterator                reverse_iterator;
+
+  /**
+    * Opens the paged btree stored at path, creating it if the file is
+    * empty or missing.
+    *
+    * @param path the backing file.
+    * @param poolPages how many pages the buffer pool may hold in memory.
+    * @param pageSize the page size of a new file; an existing file keeps
+    *        the page size it was created with.
+    * @throws std::system_error on I/O failure, std::runtime_error if the
+    *         file is not a paged btree for T.
+    */
+   paged_btree(const std::string& path, size_t poolPages = 256, size_t pageSize = 4096) {
+      open(make_page_io(path, probePageSize(path, pageSize)), poolPages);
+   }
+
+   //Opens the tree over an already constructed page_io
+   paged_btree(std::unique_ptr<page_io> pageIo, size_t poolPages) {
+      open(std::move(pageIo), poolPages);
+   }
+
+   paged_btree(const paged_btree&) = delete;
+   paged_btree& operator=(const paged_btree&) = delete;
+
+  /**
+    * Writes back every dirty page.  Errors at this point cannot be
+    * reported, so call flush() first to find out about them.
+    */
+   ~paged_btree() {
+      try {
+         flush();
+      } catch (...) {
+      }
+   }
+
+  /**
+    * Inserts elem if no matching element is present, exactly as
+    * btree::insert does.
+    *
+    * @return an iterator to the matching element, and whether elem was
+    *         inserted.
+    */
+   std::pair<const_iterator, bool> insert(const T& elem) {
+      page_ref page = fetch(meta().root);
+      for (;;) {
+         NodeHeader* h = header(page.data());
+         T* first = vals(page.data());
+         T* last = first + h->count;
+         T* it = std::lower_bound(first, last, elem);
+         size_t pos = it - first;
+         if (it != last && *it == elem) {
+            return {const_iterator(this, page, pos), false};
+         } else if (h->count < maxElems) {
+            std::memmove(static_cast<void*>(it + 1), static_cast<const void*>(it), (last - it) * sizeof(T));
+            std::memcpy(static_cast<void*>(it), &elem, sizeof(T));
+            ++h->count;
+            page.mark_dirty();
+            ++meta().count;
+            metaPage.mark_dirty();
+            return {const_iterator(this, page, pos), true};
+         }
+
+         page_id next = child(page.data(), pos);
+         if (next == 0) {
+            page_ref fresh = allocate();
+            NodeHeader* fh = header(fresh.data());
+            fh->parent = page.page();
+            fh->slot = static_cast<uint32_t>(pos);
+            next = fresh.page();
+            setChild(page.data(), pos, next);
+            page.mark_dirty();
+            page = std::move(fresh);
+         } else {
+            page = fetch(next);
+         }
+      }
+   }
+
+   const_iterator find(const T& elem) const {
+      page_id id = meta().root;
+      while (id != 0) {
+         page_ref page = fetch(id);
+         const T* first = vals(page.data());
+         const T* last = first + header(page.data())->count;
+         const T* it = std::lower_bound(first, last, elem);
+         if (it != last && *it == elem) {
+            return const_iterator(this, std::move(page), it - first);
+         }
+         id = child(page.data(), it - first);
+      }
+      return end();
+   }
+
+   const_iterator lower_bound(const T& elem) const {
+      const_iterator best = end();
+      page_id id = meta().root;
+      while (id != 0) {
+         page_ref page = fetch(id);
+         const T* first = vals(page.data());
+         const T* last = first + header(page.data())->count;
+         const T* it = std::lower_bound(first, last, elem);
+         id = child(page.data(), it - first);
+         if (it != last) {
+            bool exact = *it == elem;
+            best = const_iterator(this, std::move(page), it - first);
+            if (exact) {
+               break;
+            }
+         }
+      }
+      return best;
+   }
+
+   const_iterator begin() const {
+      return empty() ? end() : const_iterator(this, leftmost(meta().root, true), 0);
+   }
+   const_iterator end() const {
+      return const_iterator(this, page_ref(), 0);
+   }
+   const_iterator cbegin() const {
+      return begin();
+   }
+   const_iterator cend() const {
+      return end();
+   }
+   const_reverse_iterator rbegin() const {
+      return const_reverse_iterator(end());
+   }
+   const_reverse_iterator rend() const {
+      return const_reverse_iterator(begin());
+   }
+
+   size_t size() const {
+      return meta().count;
+   }
+   bool empty() const {
+      return size() == 0;
+   }
+
+   //Elements per node page
+   size_t max_node_elems() const {
+      return maxElems;
+   }
+
+   const buffer_pool& pool() const {
+      return *buffers;
+   }
+
+  /**
+    * Writes every dirty page, including the metadata page, back to the
+    * file and syncs it.
+    */
+   void flush() {
+      buffers->flush();
+   }
+
+ private:
+   static size_t probePageSize(const std::string& path, size_t pageSize) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+         return pageSize;
+      }
+      Meta m{};
+      ssize_t n = ::pread(fd, &m, sizeof(m), 0);
+      ::close(fd);
+      if (n == static_cast<ssize_t>(sizeof(m)) && std::memcmp(m.magic, fileMagic, sizeof(fileMagic)) == 0) {
+         return m.pageSize;
+      }
+      return pageSize;
+   }
+
+   static size_t valuesOffset(size_t maxNodeElems) {
+      size_t off = sizeof(NodeHeader) + (maxNodeElems + 1) * sizeof(page_id);
+      return (off + alignof(T) - 1) / alignof(T) * alignof(T);
+   }
+
+   void open(std::unique_ptr<page_io> pageIo, size_t poolPages) {
+      size_t pageSize = pageIo->page_size();
+      if (pageSize < sizeof(Meta) || valuesOffset(1) + sizeof(T) > pageSize) {
+         throw std::invalid_argument("paged_btree: page size too small for the element type");
+      }
+      maxElems = (pageSize - sizeof(NodeHeader) - sizeof(page_id)) / (sizeof(T) + sizeof(page_id));
+      while (valuesOffset(maxElems) + maxElems * sizeof(T) > pageSize) {
+         --maxElems;
+      }
+      valsAt = valuesOffset(maxElems);
+
+      bool fresh = pageIo->page_count() == 0;
+      buffers.reset(new buffer_pool(std::move(pageIo), std::max<size_t>(poolPages, 4)));
+      if (fresh) {
+         metaPage = page_ref::adopt(buffers.get(), 0, buffers->pin_new(0));
+         Meta& m = meta();
+         std::memcpy(m.magic, fileMagic, sizeof(fileMagic));
+         m.version = fileVersion;
+         m.pageSize = static_cast<uint32_t>(pageSize);
+         m.elemSize = sizeof(T);
+         m.maxNodeElems = static_cast<uint32_t>(maxElems);
+         m.pageCount = 1;
+         m.count = 0;
+         m.root = allocate().page();
+      } else {
+         metaPage = page_ref(buffers.get(), 0);
+         const Meta& m = meta();
+         if (std::memcmp(m.magic, fileMagic, sizeof(fileMagic)) != 0 || m.version != fileVersion ||
+             m.elemSize != sizeof(T) || m.pageSize != pageSize || m.maxNodeElems != maxElems) {
+            throw std::runtime_error("paged_btree: file is not a paged btree for this element type");
+         }
+      }
+   }
+
+   Meta& meta() const {
+      return *reinterpret_cast<Meta*>(metaPage.data());
+   }
+
+   //Appends a zeroed page to the file and returns it pinned
+   page_ref allocate() {
+      page_id id = meta().pageCount++;
+      metaPage.mark_dirty();
+      return page_ref::adopt(buffers.get(), id, buffers->pin_new(id));
+   }
+
+   page_ref fetch(page_id id) const {
+      return page_ref(buffers.get(), id);
+   }
+
+   NodeHeader* header(char* page) const {
+      return reinterpret_cast<NodeHeader*>(page);
+   }
+   const NodeHeader* header(const char* page) const {
+      return reinterpret_cast<const NodeHeader*>(page);
+   }
+   T* vals(char* page) const {
+      return reinterpret_cast<T*>(page + valsAt);
+   }
+   const T* vals(const char* page) const {
+      return reinterpret_cast<const T*>(page + valsAt);
+   }
+   page_id child(const char* page, size_t i) const {
+      page_id id;
+      std::memcpy(&id, page + sizeof(NodeHeader) + i * sizeof(page_id), sizeof(id));
+      return id;
+   }
+   void setChild(char* page, size_t i, page_id id) const {
+      std::memcpy(page + sizeof(NodeHeader) + i * sizeof(page_id), &id, sizeof(id));
+   }
+
+   //Descends to the first node of a subtree.  When scanning, each level
+   //on the way down is read a window of children at a time, from the one
+   //descended into on
+   page_ref leftmost(page_id id, bool scanning = false) const {
+      page_ref page = fetch(id);
+      for (page_id c = child(page.data(), 0); c != 0; c = child(page.data(), 0)) {
+         if (scanning) {
+            scanAhead(page.data(), 0, true);
+         }
+         page = fetch(c);
+      }
+      return page;
+   }
+   page_ref rightmost(page_id id, bool scanning = false) const {
+      page_ref page = fetch(id);
+      for (size_t last = header(page.data())->count; child(page.data(), last) != 0;
+           last = header(page.data())->count) {
+         if (scanning) {
+            scanAhead(page.data(), last, false);
+         }
+         page = fetch(child(page.data(), last));
+      }
+      return page;
+   }
+
+   //Before a scan steps into the child at slot: if that page is not in
+   //the pool, reads it in one batch with the siblings the scan reaches
+   //after it (those before it when going backwards).  The scan comes
+   //back to this node between siblings, so the next window is read
+   //when this one runs out
+   void scanAhead(const char* page, size_t slot, bool forward) const {
+      if (buffers->cached(child(page, slot))) {
+         return;
+      }
+      page_id ids[64];
+      size_t n = 0;
+      if (forward) {
+         for (size_t i = slot; i <= header(page)->count && n < 64; ++i) {
+            ids[n++] = child(page, i);
+         }
+      } else {
+         for (size_t i = slot + 1; i-- > 0 && n < 64;) {
+            ids[n++] = child(page, i);
+         }
+      }
+      buffers->prefetch(ids, n);
+   }
+
+   std::unique_ptr<buffer_pool> buffers;
+   page_ref metaPage;
+   size_t maxElems = 0;
+   size_t valsAt = 0;
+};
+
+#endif
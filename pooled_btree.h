@@ -0,0 +1,582 @@
+#ifndef POOLED_BTREE_H
+#define POOLED_BTREE_H
+
+/*
+ * A pooled_btree keeps every node of the tree in one growable pool and
+ * links them by 32-bit node numbers instead of pointers.  Node n's
+ * header, its maxNodeElems + 1 child links and its maxNodeElems element
+ * slots sit at index n of three arrays; node 0 is never used, so 0
+ * means no link.  A link costs 4 bytes against a btree's 16-byte
+ * shared_ptr, and as nothing in the tree is an address, the whole tree
+ * is relocatable: copying or moving it copies or moves three arrays (a
+ * memcpy each for trivially copyable T), and save writes them out as
+ * they are.
+ *
+ * The tree grows exactly like btree: an element goes into the first
+ * node on its search path with room, and a full node sprouts a child in
+ * the slot the element falls into.  Erasing fills the gap from the
+ * neighbouring subtrees as btree does; emptied nodes go on a free list
+ * for the next to be made.  T must be default constructible, as the
+ * pool holds every slot of a node from the start.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree_codec.h"
+
+template <typename T>
+class pooled_btree {
+   typedef uint32_t node_id;
+
+   struct NodeHeader {
+      uint32_t count;
+      node_id parent;      // on the free list, the next free node
+   };
+
+   static constexpr char fileMagic[8] = {'B', 'T', 'R', 'E', 'P', 'O', 'O', 'L'};
+   static constexpr uint32_t fileVersion = 1;
+
+ public:
+   class const_iterator {
+    public:
+      typedef std::ptrdiff_t                  difference_type;
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef const T                         value_type;
+      typedef const T*                        pointer;
+      typedef const T&                        reference;
+
+      const_iterator(): tree{nullptr}, node{0}, pos{0} {}
+
+      reference operator*() const {
+         return tree->vals(node)[pos];
+      }
+      pointer operator->() const {
+         return &(operator*());
+      }
+
+      const_iterator& operator++() {
+         node_id child = tree->link(node, pos + 1);
+         if (child != 0) {
+            node = tree->leftmost(child);
+            pos = 0;
+         } else if (++pos == tree->nodes[node].count) {
+            while (node != 0 && pos == tree->nodes[node].count) {
+               node_id parent = tree->nodes[node].parent;
+               pos = parent != 0 ? tree->slotOf(parent, node) : 0;
+               node = parent;
+            }
+         }
+         return *this;
+      }
+
+      const_iterator operator++(int) {
+         const_iterator tmp{*this};
+         operator++();
+         return tmp;
+      }
+
+      const_iterator& operator--() {
+         if (node == 0) {
+            node = tree->rightmost(tree->root);
+            pos = tree->nodes[node].count - 1;
+            return *this;
+         }
+         node_id child = tree->link(node, pos);
+         if (child != 0) {
+            node = tree->rightmost(child);
+            pos = tree->nodes[node].count - 1;
+         } else {
+            while (pos == 0) {
+               node_id parent = tree->nodes[node].parent;
+               pos = tree->slotOf(parent, node);
+               node = parent;
+            }
+            --pos;
+         }
+         return *this;
+      }
+
+      const_iterator operator--(int) {
+         const_iterator tmp{*this};
+         operator--();
+         return tmp;
+      }
+
+      bool operator==(const const_iterator& other) const {
+         return node == other.node && pos == other.pos;
+      }
+      bool operator!=(const const_iterator& other) const {
+         return !operator==(other);
+      }
+
+    private:
+      friend class pooled_btree<T>;
+      const_iterator(const pooled_btree* t, node_id n, size_t i): tree{t}, node{n}, pos{i} {}
+
+      const pooled_btree* tree;
+      node_id node;
+      size_t pos;
+   };
+
+   typedef const_iterator                        iterator;
+   typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+   typedef const_reverse_iterator                reverse_iterator;
+
+  /**
+    * Constructs an empty tree.
+    *
+    * @param maxNodeElems the maximum number of elements stored in each
+    *        node.
+    */
+   pooled_btree(size_t maxNodeElems = 40): maxElems{std::max<size_t>(maxNodeElems, 1)} {
+      clear();
+   }
+
+  /**
+    * Inserts elem if no matching element is present, exactly as
+    * btree::insert does.
+    *
+    * @return an iterator to the matching element, and whether elem was
+    *         inserted.
+    */
+   std::pair<const_iterator, bool> insert(const T& elem) {
+      node_id node = root;
+      for (;;) {
+         T* first = vals(node);
+         size_t n = nodes[node].count;
+         size_t pos = std::lower_bound(first, first + n, elem) - first;
+         if (pos < n && first[pos] == elem) {
+            return {const_iterator(this, node, pos), false};
+         }
+         node_id next = link(node, pos);
+         if (next != 0) {
+            node = next;
+         } else if (n < maxElems) {
+            //a part-full node may still have children; the links right of
+            //elem move along with it and the one it opens is empty
+            std::move_backward(first + pos, first + n, first + n + 1);
+            first[pos] = elem;
+            node_id* links = linksOf(node);
+            std::move_backward(links + pos + 1, links + n + 1, links + n + 2);
+            links[pos + 1] = 0;
+            ++nodes[node].count;
+            ++count;
+            return {const_iterator(this, node, pos), true};
+         } else {
+            next = allocate(node);
+            link(node, pos) = next;
+            node = next;
+         }
+      }
+   }
+
+  /**
+    * Removes the matching element, if there is one.
+    *
+    * @return the number of elements removed (0 or 1).
+    */
+   size_t erase(const T& elem) {
+      const_iterator it = find(elem);
+      if (it == end()) {
+         return 0;
+      }
+      eraseAt(it.node, it.pos);
+      return 1;
+   }
+
+   const_iterator find(const T& elem) const {
+      node_id node = root;
+      while (node != 0) {
+         const T* first = vals(node);
+         const T* last = first + nodes[node].count;
+         const T* it = std::lower_bound(first, last, elem);
+         if (it != last && *it == elem) {
+            return const_iterator(this, node, it - first);
+         }
+         node = link(node, it - first);
+      }
+      return end();
+   }
+
+   const_iterator lower_bound(const T& elem) const {
+      const_iterator best = end();
+      node_id node = root;
+      while (node != 0) {
+         const T* first = vals(node);
+         const T* last = first + nodes[node].count;
+         const T* it = std::lower_bound(first, last, elem);
+         if (it != last) {
+            best = const_iterator(this, node, it - first);
+            if (*it == elem) {
+               break;
+            }
+         }
+         node = link(node, it - first);
+      }
+      return best;
+   }
+
+   bool contains(const T& elem) const {
+      return find(elem) != end();
+   }
+
+   const_iterator begin() const {
+      return empty() ? end() : const_iterator(this, leftmost(root), 0);
+   }
+   const_iterator end() const {
+      return const_iterator(this, 0, 0);
+   }
+   const_iterator cbegin() const {
+      return begin();
+   }
+   const_iterator cend() const {
+      return end();
+   }
+   const_reverse_iterator rbegin() const {
+      return const_reverse_iterator(end());
+   }
+   const_reverse_iterator rend() const {
+      return const_reverse_iterator(begin());
+   }
+
+   size_t size() const {
+      return count;
+   }
+   bool empty() const {
+      return count == 0;
+   }
+
+   //Elements per node
+   size_t max_node_elems() const {
+      return maxElems;
+   }
+
+   //Nodes the pool holds, in use or free
+   size_t node_count() const {
+      return nodes.size() - 1;
+   }
+
+   //Empties the tree and releases the pool
+   void clear() {
+      nodes.assign(1, NodeHeader{0, 0});
+      links.assign(maxElems + 1, 0);
+      elems.assign(maxElems, T());
+      freeList = 0;
+      count = 0;
+      root = allocate(0);
+   }
+
+  /**
+    * Writes the tree to os as it is held: a header, then the node
+    * headers, links and elements as raw bytes. Only for trivially
+    * copyable T, and only portable between machines of the same ABI.
+    *
+    * @param os the stream to write to; should be opened in binary mode.
+    * @throws std::runtime_error if the stream goes bad.
+    */
+   void save(std::ostream& os) const {
+      static_assert(std::is_trivially_copyable<T>::value, "pooled_btree::save writes elements as raw bytes");
+      std::string header(fileMagic, sizeof(fileMagic));
+      btree_bytes::putFixed<uint32_t>(header, fileVersion);
+      btree_bytes::putFixed<uint32_t>(header, static_cast<uint32_t>(sizeof(T)));
+      btree_bytes::putFixed<uint32_t>(header, static_cast<uint32_t>(maxElems));
+      btree_bytes::putFixed<uint32_t>(header, static_cast<uint32_t>(nodes.size()));
+      btree_bytes::putFixed<uint32_t>(header, root);
+      btree_bytes::putFixed<uint32_t>(header, freeList);
+      btree_bytes::putFixed<uint64_t>(header, count);
+      os.write(header.data(), header.size());
+      writeArray(os, nodes);
+      writeArray(os, links);
+      writeArray(os, elems);
+      if (!os) {
+         throw std::runtime_error("pooled_btree::save: write failed");
+      }
+   }
+
+  /**
+    * Replaces the contents with a tree written by save.  The stream is
+    * not trusted: the arrays are read a chunk at a time, so a header
+    * claiming more than the stream holds fails before it is allocated,
+    * and the nodes must form one tree plus a free list before any of it
+    * is used.
+    *
+    * @param is the stream to read from; should be opened in binary mode.
+    * @throws std::runtime_error if the stream does not hold a pooled
+    *         btree of T; the tree is then left unchanged.
+    */
+   void load(std::istream& is) {
+      static_assert(std::is_trivially_copyable<T>::value, "pooled_btree::load reads elements as raw bytes");
+      char header[sizeof(fileMagic) + 6 * sizeof(uint32_t) + sizeof(uint64_t)];
+      if (!is.read(header, sizeof(header)) || std::memcmp(header, fileMagic, sizeof(fileMagic)) != 0) {
+         throw std::runtime_error("pooled_btree::load: not a pooled btree");
+      }
+      const char* in = header + sizeof(fileMagic);
+      auto next = [&in] {
+         uint32_t v = btree_bytes::getFixed<uint32_t>(in);
+         in += sizeof(uint32_t);
+         return v;
+      };
+      uint32_t version = next();
+      uint32_t elemSize = next();
+      size_t maxNodeElems = next();
+      size_t nodeCount = next();
+      node_id rootAt = next();
+      node_id freeAt = next();
+      uint64_t elemCount = btree_bytes::getFixed<uint64_t>(in);
+      if (version != fileVersion) {
+         throw std::runtime_error("pooled_btree::load: unsupported version");
+      }
+      if (elemSize != sizeof(T) || maxNodeElems == 0 || maxNodeElems > loadMaxNodeElems || nodeCount < 2 ||
+          rootAt == 0 || rootAt >= nodeCount || freeAt >= nodeCount ||
+          nodeCount * maxNodeElems > std::vector<T>().max_size()) {
+         throw std::runtime_error("pooled_btree::load: bad header");
+      }
+
+      std::vector<NodeHeader> newNodes;
+      std::vector<node_id> newLinks;
+      std::vector<T> newElems;
+      if (!readArray(is, newNodes, nodeCount) || !readArray(is, newLinks, nodeCount * (maxNodeElems + 1)) ||
+          !readArray(is, newElems, nodeCount * maxNodeElems)) {
+         throw std::runtime_error("pooled_btree::load: truncated");
+      }
+      checkPool(newNodes, newLinks, maxNodeElems, rootAt, freeAt, elemCount);
+      maxElems = maxNodeElems;
+      nodes = std::move(newNodes);
+      links = std::move(newLinks);
+      elems = std::move(newElems);
+      root = rootAt;
+      freeList = freeAt;
+      count = elemCount;
+   }
+
+ private:
+   template <typename U>
+   static void writeArray(std::ostream& os, const std::vector<U>& array) {
+      os.write(reinterpret_cast<const char*>(array.data()), array.size() * sizeof(U));
+   }
+
+   //Most elements per node load accepts
+   static constexpr size_t loadMaxNodeElems = size_t{1} << 20;
+
+   //Reads n elements into array, growing it a chunk at a time so a
+   //truncated stream is found before a claimed size is allocated
+   template <typename U>
+   static bool readArray(std::istream& is, std::vector<U>& array, size_t n) {
+      const size_t chunk = std::max<size_t>(1, (size_t{1} << 20) / sizeof(U));
+      array.clear();
+      while (array.size() < n) {
+         size_t done = array.size();
+         array.resize(done + std::min(chunk, n - done));
+         if (!is.read(reinterpret_cast<char*>(array.data() + done), (array.size() - done) * sizeof(U))) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   //Checks that the nodes reachable from rootAt form a tree holding
+   //elemCount elements, and that every other node is on the free list
+   //from freeAt, before load trusts any link, count or parent
+   static void checkPool(const std::vector<NodeHeader>& heads, const std::vector<node_id>& linkArray,
+                         size_t maxNodeElems, node_id rootAt, node_id freeAt, uint64_t elemCount) {
+      auto fail = [] {
+         throw std::runtime_error("pooled_btree::load: corrupt pool");
+      };
+      auto linksAt = [&](node_id node) {
+         return linkArray.data() + static_cast<size_t>(node) * (maxNodeElems + 1);
+      };
+      std::vector<bool> seen(heads.size());
+      uint64_t held = 0;
+      std::vector<node_id> pending{rootAt};
+      if (heads[rootAt].parent != 0) {
+         fail();
+      }
+      seen[rootAt] = true;
+      while (!pending.empty()) {
+         node_id node = pending.back();
+         pending.pop_back();
+         size_t n = heads[node].count;
+         if (n > maxNodeElems || (n == 0 && node != rootAt)) {
+            fail();
+         }
+         held += n;
+         const node_id* l = linksAt(node);
+         for (size_t i = 0; i <= maxNodeElems; ++i) {
+            if (l[i] == 0) {
+               continue;
+            }
+            //children hang only from the slots in use, each exactly once
+            if (i > n || l[i] >= heads.size() || seen[l[i]] || heads[l[i]].parent != node) {
+               fail();
+            }
+            seen[l[i]] = true;
+            pending.push_back(l[i]);
+         }
+      }
+      if (held != elemCount || (heads[rootAt].count == 0 && elemCount != 0)) {
+         fail();
+      }
+      for (node_id node = freeAt; node != 0; node = heads[node].parent) {
+         if (node >= heads.size() || seen[node] || heads[node].count != 0) {
+            fail();
+         }
+         seen[node] = true;
+         const node_id* l = linksAt(node);
+         if (std::any_of(l, l + maxNodeElems + 1, [](node_id c) { return c != 0; })) {
+            fail();
+         }
+      }
+      if (std::find(seen.begin() + 1, seen.end(), false) != seen.end()) {
+         fail();
+      }
+   }
+
+   T* vals(node_id node) {
+      return elems.data() + static_cast<size_t>(node) * maxElems;
+   }
+   const T* vals(node_id node) const {
+      return elems.data() + static_cast<size_t>(node) * maxElems;
+   }
+   node_id* linksOf(node_id node) {
+      return links.data() + static_cast<size_t>(node) * (maxElems + 1);
+   }
+   node_id& link(node_id node, size_t i) {
+      return linksOf(node)[i];
+   }
+   node_id link(node_id node, size_t i) const {
+      return links[static_cast<size_t>(node) * (maxElems + 1) + i];
+   }
+
+   //Where child hangs off parent
+   size_t slotOf(node_id parent, node_id child) const {
+      size_t i = 0;
+      while (link(parent, i) != child) {
+         ++i;
+      }
+      return i;
+   }
+
+   node_id leftmost(node_id node) const {
+      for (node_id c = link(node, 0); c != 0; c = link(node, 0)) {
+         node = c;
+      }
+      return node;
+   }
+   node_id rightmost(node_id node) const {
+      for (node_id c = link(node, nodes[node].count); c != 0; c = link(node, nodes[node].count)) {
+         node = c;
+      }
+      return node;
+   }
+
+   //Takes a node off the free list, or grows the pool by one. Pointers
+   //into the pool do not survive this
+   node_id allocate(node_id parent) {
+      node_id node = freeList;
+      if (node != 0) {
+         freeList = nodes[node].parent;
+      } else {
+         if (nodes.size() > std::numeric_limits<node_id>::max()) {
+            throw std::length_error("pooled_btree: more nodes than 32-bit links can reach");
+         }
+         node = static_cast<node_id>(nodes.size());
+         nodes.push_back(NodeHeader{0, 0});
+         links.resize(links.size() + maxElems + 1, 0);
+         elems.resize(elems.size() + maxElems);
+      }
+      nodes[node] = NodeHeader{0, parent};
+      return node;
+   }
+
+   //Puts an empty, childless node on the free list
+   void release(node_id node) {
+      nodes[node] = NodeHeader{0, freeList};
+      std::fill(linksOf(node), linksOf(node) + maxElems + 1, 0);
+      freeList = node;
+   }
+
+   //Links child, which may be none, where node hung, and frees node
+   void replace(node_id node, node_id child) {
+      node_id parent = nodes[node].parent;
+      link(parent, slotOf(parent, node)) = child;
+      if (child != 0) {
+         nodes[child].parent = parent;
+      }
+      release(node);
+   }
+
+   //Removes and returns the largest element of the subtree hanging off
+   //owner at slot. The node it came from is replaced by its remaining
+   //child once it runs empty
+   T popMax(node_id owner, size_t slot) {
+      node_id node = rightmost(link(owner, slot));
+      T x = std::move(vals(node)[--nodes[node].count]);
+      if (nodes[node].count == 0) {
+         replace(node, link(node, 0));
+      }
+      return x;
+   }
+
+   //Mirror image of popMax
+   T popMin(node_id owner, size_t slot) {
+      node_id node = leftmost(link(owner, slot));
+      size_t n = nodes[node].count;
+      T* first = vals(node);
+      T x = std::move(first[0]);
+      std::move(first + 1, first + n, first);
+      node_id* links = linksOf(node);
+      std::move(links + 1, links + n + 1, links);
+      links[n] = 0;
+      if (--nodes[node].count == 0) {
+         replace(node, links[0]);
+      }
+      return x;
+   }
+
+   //Removes the element at pos in node, as btree's eraseAt does
+   void eraseAt(node_id node, size_t pos) {
+      if (link(node, pos) != 0) {
+         T x = popMax(node, pos);
+         vals(node)[pos] = std::move(x);
+      } else if (link(node, pos + 1) != 0) {
+         T x = popMin(node, pos + 1);
+         vals(node)[pos] = std::move(x);
+      } else {
+         size_t n = nodes[node].count;
+         T* first = vals(node);
+         std::move(first + pos + 1, first + n, first + pos);
+         node_id* links = linksOf(node);
+         std::move(links + pos + 2, links + n + 1, links + pos + 1);
+         links[n] = 0;
+         if (--nodes[node].count == 0 && node != root) {
+            node_id parent = nodes[node].parent;
+            link(parent, slotOf(parent, node)) = 0;
+            release(node);
+         }
+      }
+      --count;
+   }
+
+   size_t maxElems;
+   node_id root = 0;
+   node_id freeList = 0;
+   size_t count = 0;
+   //indexed by node number; node 0 is never used
+   std::vector<NodeHeader> nodes;
+   std::vector<node_id> links;
+   std::vector<T> elems;
+};
+
+#endif
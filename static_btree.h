@@ -0,0 +1,361 @@
+#ifndef STATIC_BTREE_H
+#define STATIC_BTREE_H
+
+/*
+ * A static_btree is an immutable sorted set stored in one contiguous
+ * array in Eytzinger (breadth-first) order: the root at slot 1 and the
+ * children of slot k at 2k and 2k + 1, so a search walks down the array
+ * with no pointers to chase.  Produced by btree<T>::freeze once an index
+ * stops changing.
+ *
+ * Searches are branchless - each step picks a child by arithmetic on a
+ * comparison - and prefetch the cache line holding the node's
+ * descendants a few levels down, so memory latency overlaps the
+ * comparisons above it.  The array is cache-line aligned so those
+ * descendants share one line.
+ *
+ * For integer keys, learn() adds a learned index (btree_pgm) that
+ * predicts an element's rank to within a guaranteed error, and lays the
+ * array out in sorted order instead, so the predicted window of ranks is
+ * a few adjacent cache lines.  Lookups then replace the descent with a
+ * prediction and a binary search of that window.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree_learned.h"
+
+template <typename T>
+class static_btree {
+ public:
+   class const_iterator {
+    public:
+      typedef std::ptrdiff_t                  difference_type;
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef const T                         value_type;
+      typedef const T*                        pointer;
+      typedef const T&                        reference;
+
+      const_iterator(): tree{nullptr}, slot{0} {}
+
+      reference operator*() const {
+         return tree->slots[slot];
+      }
+      pointer operator->() const {
+         return &(operator*());
+      }
+
+      //in-order successor: the leftmost of the right subtree, else the
+      //first ancestor we reach from a left child (slot 0 past the end).
+      //Once learned, the array is simply sorted
+      const_iterator& operator++() {
+         if (tree->model != nullptr) {
+            slot = slot < tree->count ? slot + 1 : 0;
+         } else if (2 * slot + 1 <= tree->count) {
+            slot = 2 * slot + 1;
+            while (2 * slot <= tree->count) {
+               slot = 2 * slot;
+            }
+         } else {
+            slot = climb(slot);
+         }
+         return *this;
+      }
+
+      const_iterator operator++(int) {
+         const_iterator tmp{*this};
+         operator++();
+         return tmp;
+      }
+
+      const_iterator& operator--() {
+         if (tree->model != nullptr) {
+            slot = slot != 0 ? slot - 1 : tree->count;
+         } else if (slot == 0) {
+            slot = tree->count != 0 ? 1 : 0;
+            while (2 * slot + 1 <= tree->count) {
+               slot = 2 * slot + 1;
+            }
+         } else if (2 * slot <= tree->count) {
+            slot = 2 * slot;
+            while (2 * slot + 1 <= tree->count) {
+               slot = 2 * slot + 1;
+            }
+         } else {
+            while (slot % 2 == 0) {
+               slot /= 2;
+            }
+            slot /= 2;
+         }
+         return *this;
+      }
+
+      const_iterator operator--(int) {
+         const_iterator tmp{*this};
+         operator--();
+         return tmp;
+      }
+
+      bool operator==(const const_iterator& other) const {
+         return slot == other.slot;
+      }
+      bool operator!=(const const_iterator& other) const {
+         return !operator==(other);
+      }
+
+    private:
+      friend class static_btree<T>;
+      const_iterator(const static_btree* t, size_t s): tree{t}, slot{s} {}
+
+      const static_btree* tree;
+      size_t slot;
+   };
+
+   typedef const_iterator                        iterator;
+   typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+   typedef const_reverse_iterator                reverse_iterator;
+
+   static_btree() = default;
+
+  /**
+    * Builds the array from a sorted range of distinct elements.
+    *
+    * @param first the smallest element.
+    * @param last one past the largest element.
+    */
+   template <typename InputIt>
+   static_btree(InputIt first, InputIt last) {
+      std::vector<T> sorted(first, last);
+      allocate(sorted.size());
+      size_t next = 0;
+      fill(1, sorted, next);
+   }
+
+   static_btree(const static_btree& original): model{original.model} {
+      allocate(original.count);
+      for (size_t k = 1; k <= count; ++k) {
+         new (slots + k) T(original.slots[k]);
+      }
+   }
+
+   static_btree(static_btree&& original): slots{original.slots}, count{original.count},
+                                          model{std::move(original.model)} {
+      original.slots = nullptr;
+      original.count = 0;
+   }
+
+   static_btree& operator=(const static_btree& rhs) {
+      if (this != &rhs) {
+         static_btree tmp{rhs};
+         *this = std::move(tmp);
+      }
+      return *this;
+   }
+
+   static_btree& operator=(static_btree&& rhs) {
+      if (this != &rhs) {
+         release();
+         slots = rhs.slots;
+         count = rhs.count;
+         model = std::move(rhs.model);
+         rhs.slots = nullptr;
+         rhs.count = 0;
+      }
+      return *this;
+   }
+
+   ~static_btree() {
+      release();
+   }
+
+   size_t size() const {
+      return count;
+   }
+   bool empty() const {
+      return count == 0;
+   }
+
+   const_iterator begin() const {
+      size_t k = count != 0 ? 1 : 0;
+      while (2 * k <= count && k != 0 && model == nullptr) {
+         k = 2 * k;
+      }
+      return const_iterator(this, k);
+   }
+   const_iterator end() const {
+      return const_iterator(this, 0);
+   }
+   const_iterator cbegin() const {
+      return begin();
+   }
+   const_iterator cend() const {
+      return end();
+   }
+   const_reverse_iterator rbegin() const {
+      return const_reverse_iterator(end());
+   }
+   const_reverse_iterator rend() const {
+      return const_reverse_iterator(begin());
+   }
+
+  /**
+    * Returns an iterator to the matching element, or end() if there is
+    * none.
+    *
+    * @param elem the element to search for.
+    */
+   const_iterator find(const T& elem) const {
+      size_t k = search(elem);
+      return k != 0 && !(elem < slots[k]) ? const_iterator(this, k) : end();
+   }
+
+  /**
+    * Returns an iterator to the first element not less than elem, or
+    * end() if every element is less than elem.
+    *
+    * @param elem the element to search for.
+    */
+   const_iterator lower_bound(const T& elem) const {
+      return const_iterator(this, search(elem));
+   }
+
+   bool contains(const T& elem) const {
+      return find(elem) != end();
+   }
+
+  /**
+    * Builds a learned index over the elements, which lookups use from
+    * then on, and re-lays the array in sorted order. Only for integer
+    * elements; it pays off when their distribution is smooth enough for
+    * few segments to fit it, and otherwise loses to the Eytzinger search.
+    * Iterators from before are invalidated.
+    *
+    * @param maxError how many ranks a prediction may be off by; lookups
+    *        search a window of about twice this.
+    */
+   void learn(size_t maxError = 32) {
+      static_assert(std::is_integral<T>::value, "only integer elements can be learned");
+      if (model == nullptr) {
+         std::vector<T> sorted(begin(), end());
+         std::copy(sorted.begin(), sorted.end(), slots + 1);
+      }
+      model = std::make_shared<const btree_pgm<T>>(count, [this](size_t rank) { return slots[rank + 1]; },
+                                                   maxError);
+   }
+
+   //the learned index, or null
+   const btree_pgm<T>* learned() const {
+      return model.get();
+   }
+
+ private:
+   static constexpr size_t lineBytes = 64;
+
+   //Descendants this many times deeper in the array (2^levels) share one
+   //cache line with each other
+   static constexpr size_t prefetchStride() {
+      size_t stride = 1;
+      while (stride * 2 * sizeof(T) <= lineBytes) {
+         stride *= 2;
+      }
+      return stride;
+   }
+
+   //Slot of the first element not less than elem, or 0
+   size_t search(const T& elem) const {
+      if constexpr (std::is_integral<T>::value) {
+         if (model != nullptr) {
+            //fetch the whole window at once rather than a line per probe
+            auto [lo, hi] = model->window(elem);
+            for (size_t r = lo; r <= hi; r += lineBytes / sizeof(T)) {
+               prefetch(r + 1);
+            }
+            const T* first = slots + 1;
+            size_t rank = std::lower_bound(first + lo, first + hi, elem) - first;
+            return rank < count ? rank + 1 : 0;
+         }
+      }
+      size_t k = 1;
+      while (k <= count) {
+         prefetch(k * prefetchStride());
+         k = 2 * k + (slots[k] < elem);
+      }
+      //the answer is the last node where we went left: undo the trailing
+      //right turns and then that left turn
+      return climb(k);
+   }
+
+   //The slot's address is formed as an integer: near the bottom it lies
+   //past the array, which prefetching tolerates but pointer arithmetic
+   //does not
+   void prefetch(size_t k) const {
+#if defined(__GNUC__)
+      __builtin_prefetch(reinterpret_cast<const void*>(reinterpret_cast<uintptr_t>(slots) + k * sizeof(T)));
+#else
+      (void)k;
+#endif
+   }
+
+   //Drops the trailing right turns from a slot number, then one more step
+   static size_t climb(size_t k) {
+      return k >> (trailingZeros(~k) + 1);
+   }
+
+   static size_t trailingZeros(size_t n) {
+#if defined(__GNUC__)
+      return __builtin_ctzll(static_cast<unsigned long long>(n));
+#else
+      size_t bits = 0;
+      while (n % 2 == 0) {
+         n /= 2;
+         ++bits;
+      }
+      return bits;
+#endif
+   }
+
+   void allocate(size_t n) {
+      count = n;
+      if (n != 0) {
+         slots = static_cast<T*>(::operator new((n + 1) * sizeof(T), std::align_val_t{lineBytes}));
+      }
+   }
+
+   //Places sorted elements in order across the subtree rooted at slot k
+   void fill(size_t k, std::vector<T>& sorted, size_t& next) {
+      if (k > count) {
+         return;
+      }
+      fill(2 * k, sorted, next);
+      new (slots + k) T(std::move(sorted[next++]));
+      fill(2 * k + 1, sorted, next);
+   }
+
+   void release() {
+      if (slots != nullptr) {
+         for (size_t k = 1; k <= count; ++k) {
+            slots[k].~T();
+         }
+         ::operator delete(slots, std::align_val_t{lineBytes});
+      }
+      slots = nullptr;
+      count = 0;
+      model.reset();
+   }
+
+   //slot 0 is never constructed
+   T* slots = nullptr;
+   size_t count = 0;
+   //shared by copies, as it never changes once built
+   std::shared_ptr<const btree_pgm<T>> model;
+};
+
+#endif